@@ -0,0 +1,284 @@
+#include <string.h>
+#include <math.h>
+#include "audio_resample.h"
+
+#define ONE             (1u << 16)
+#define ZERO_CROSSINGS  8
+#define CUTOFF          0.85
+#define KAISER_BETA     8.0
+#define LANES           8
+
+/*
+ * 第一类零阶修正贝塞尔函数，用于Kaiser窗
+ */
+static double BesselI0 (double x)
+{
+    double sum  = 1;
+    double term = 1;
+    for (int k = 1; k < 32; k++)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/*
+ * coeffs[p * taps + j]是相位p/PHASES时第j个输入样本的系数，共PHASES + 1行，
+ * 最后一行供相位插值使用。每一行归一化为直流增益1
+ */
+static void AudioResamplerDesign (AudioResampler *resampler,
+                                  double          cutoff)
+{
+    const int    taps = resampler->taps;
+    const int    half = taps / 2;
+    const double norm = BesselI0 (KAISER_BETA);
+    for (int p = 0; p <= AUDIO_RESAMPLER_PHASES; p++)
+    {
+        float *row = resampler->coeffs + p * taps;
+        double sum = 0;
+        for (int j = 0; j < taps; j++)
+        {
+            double d = j - (half - 1) - (double)p / AUDIO_RESAMPLER_PHASES;
+            double x = d / half;
+            double h = cutoff;
+            if (d != 0)
+                h = sin (M_PI * cutoff * d) / (M_PI * d);
+            double w = fabs (x) < 1 ? BesselI0 (KAISER_BETA * sqrt (1 - x * x)) / norm : 0;
+            row[j] = (float)(h * w);
+            sum += row[j];
+        }
+        for (int j = 0; j < taps; j++)
+            row[j] = (float)(row[j] / sum);
+    }
+}
+
+void AudioResamplerInit (AudioResampler *resampler,
+                         int             in_rate,
+                         int             out_rate)
+{
+    memset (resampler, 0, sizeof (AudioResampler));
+    resampler->in_rate  = in_rate;
+    resampler->out_rate = out_rate;
+    resampler->step     = (uint32_t)(((uint64_t)in_rate << 16) / out_rate);
+    resampler->base_step = resampler->step;
+/*
+ * 截止频率以输入的奈奎斯特频率为1，降采样时按比例降低，
+ * 滤波器覆盖ZERO_CROSSINGS个零点，降得越多需要的输入样本越多
+ */
+    double cutoff = CUTOFF * (out_rate < in_rate ? (double)out_rate / in_rate : 1.0);
+    int    taps   = 2 * (int)ceil (ZERO_CROSSINGS / cutoff);
+    taps = (taps + LANES - 1) / LANES * LANES;
+    resampler->taps = taps < AUDIO_RESAMPLER_MAX_TAPS ? taps : AUDIO_RESAMPLER_MAX_TAPS;
+    resampler->pos  = (uint64_t)(resampler->taps / 2 - 1) << 16;
+    AudioResamplerDesign (resampler,
+                          cutoff);
+}
+
+/*
+ * ratio为输入与输出的相对速度，大于1时消耗输入更快
+ * 用于补偿发送端与本地声卡之间的时钟偏差，只应在1附近小幅调整
+ */
+void AudioResamplerSetRatio (AudioResampler *resampler,
+                             double          ratio)
+{
+    resampler->variable = 1;
+    resampler->step     = (uint32_t)(resampler->base_step * ratio + 0.5);
+}
+
+/*
+ * in_frames个输入样本最多产生的输出样本数，用于分配缓冲区
+ */
+int AudioResamplerMaxOutput (const AudioResampler *resampler,
+                             int                   in_frames)
+{
+/*
+ * 变比最多在base_step的基础上减小1%
+ */
+    uint32_t step = resampler->base_step - resampler->base_step / 100;
+    return (int)(((uint64_t)in_frames << 16) / step) + 3;
+}
+
+/*
+ * 保留输入序列 hist, in 的最后taps个样本
+ */
+static void AudioKeepHistory (AudioResampler *resampler,
+                              const float    *in,
+                              int             in_frames)
+{
+    const int taps = resampler->taps;
+    if (in_frames >= taps)
+    {
+        memcpy (resampler->hist,
+                in + in_frames - taps,
+                taps * sizeof (float));
+        return;
+    }
+    memmove (resampler->hist,
+             resampler->hist + in_frames,
+             (taps - in_frames) * sizeof (float));
+    memcpy (resampler->hist + taps - in_frames,
+            in,
+            in_frames * sizeof (float));
+}
+
+/*
+ * 一个输出样本：x与相位a、b两行系数按f插值后的内积
+ * 按LANES路分别累加，内层循环是定长的，编译器可以直接向量化
+ */
+static inline float AudioDot (const float *restrict x,
+                              const float *restrict a,
+                              const float *restrict b,
+                              float                 f,
+                              int                   taps)
+{
+    float acc[LANES] = { 0 };
+    for (int j = 0; j < taps; j += LANES)
+        for (int k = 0; k < LANES; k++)
+            acc[k] += x[j + k] * (a[j + k] + f * (b[j + k] - a[j + k]));
+    float sum = 0;
+    for (int k = 0; k < LANES; k++)
+        sum += acc[k];
+    return sum;
+}
+
+/*
+ * 输入序列看作 hist[0..taps-1], in[0..]，位置用定点数表示
+ * 位置e+t的输出用e-taps/2+1到e+taps/2的taps个样本，所以输出比输入晚taps/2个样本
+ * 窗口落在hist与in交界处的输出从拼接缓冲区读，其余直接读in，内层循环没有分支
+ */
+static int AudioFilter (AudioResampler *resampler,
+                        const float    *restrict in,
+                        int             in_frames,
+                        float          *restrict out)
+{
+    const int      taps  = resampler->taps;
+    const int      half  = taps / 2;
+    const uint64_t end   = (uint64_t)(taps + in_frames - half) << 16;
+    uint64_t       pos   = resampler->pos;
+    int            count = 0;
+    float          joint[2 * AUDIO_RESAMPLER_MAX_TAPS];
+    int            n     = in_frames < taps ? in_frames : taps;
+
+    memcpy (joint,
+            resampler->hist,
+            taps * sizeof (float));
+    memcpy (joint + taps,
+            in,
+            n * sizeof (float));
+    while (pos < end)
+    {
+        uint32_t     e     = (uint32_t)(pos >> 16);
+        uint32_t     phase = (uint32_t)(pos & (ONE - 1)) * AUDIO_RESAMPLER_PHASES;
+        float        f     = (float)(phase & (ONE - 1)) * (1.0f / ONE);
+        const float *a     = resampler->coeffs + (phase >> 16) * taps;
+        int          w     = (int)e - half + 1;
+        const float *x     = w < taps ? joint + w : in + (w - taps);
+        out[count++] = AudioDot (x,
+                                 a,
+                                 a + taps,
+                                 f,
+                                 taps);
+        pos += resampler->step;
+    }
+    resampler->pos = pos - ((uint64_t)in_frames << 16);
+    AudioKeepHistory (resampler,
+                      in,
+                      in_frames);
+    return count;
+}
+
+/*
+ * 返回写入out的样本数，out至少要有AudioResamplerMaxOutput个样本的空间
+ */
+int AudioResample (AudioResampler *resampler,
+                   const float    *in,
+                   int             in_frames,
+                   float          *out)
+{
+    if (in_frames <= 0)
+        return 0;
+    if (!resampler->variable
+    && resampler->step == ONE)
+    {
+        memcpy (out,
+                in,
+                in_frames * sizeof (float));
+        AudioKeepHistory (resampler,
+                          in,
+                          in_frames);
+        return in_frames;
+    }
+    return AudioFilter (resampler,
+                        in,
+                        in_frames,
+                        out);
+}
+
+void AudioDownmixS16 (const int16_t *restrict in,
+                      int            frames,
+                      int            channels,
+                      float         *restrict out)
+{
+    const float scale = 1.0f / (32768.0f * channels);
+    if (channels == 2)
+    {
+        for (int i = 0; i < frames; i++)
+            out[i] = (float)(in[2 * i] + in[2 * i + 1]) * scale;
+        return;
+    }
+    for (int i = 0; i < frames; i++)
+    {
+        int sum = 0;
+        for (int c = 0; c < channels; c++)
+            sum += in[i * channels + c];
+        out[i] = (float)sum * scale;
+    }
+}
+
+void AudioDownmixF32 (const float *restrict in,
+                      int          frames,
+                      int          channels,
+                      float       *restrict out)
+{
+    const float scale = 1.0f / channels;
+    if (channels == 1)
+    {
+        memcpy (out,
+                in,
+                frames * sizeof (float));
+        return;
+    }
+    for (int i = 0; i < frames; i++)
+    {
+        float sum = 0;
+        for (int c = 0; c < channels; c++)
+            sum += in[i * channels + c];
+        out[i] = sum * scale;
+    }
+}
+
+void AudioUpmixS16 (const float *restrict in,
+                    int          frames,
+                    int          channels,
+                    int16_t     *restrict out)
+{
+    for (int i = 0; i < frames; i++)
+    {
+        float v = in[i] * 32767.0f;
+        v = v > 32767.0f ? 32767.0f : v;
+        v = v < -32768.0f ? -32768.0f : v;
+        for (int c = 0; c < channels; c++)
+            out[i * channels + c] = (int16_t)v;
+    }
+}
+
+void AudioUpmixF32 (const float *restrict in,
+                    int          frames,
+                    int          channels,
+                    float       *restrict out)
+{
+    for (int i = 0; i < frames; i++)
+        for (int c = 0; c < channels; c++)
+            out[i * channels + c] = in[i];
+}
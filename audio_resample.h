@@ -0,0 +1,62 @@
+#ifndef _AUDIO_RESAMPLE_H
+#define _AUDIO_RESAMPLE_H
+
+#include <stdint.h>
+
+/*
+ * 声卡原生格式与Opus编解码格式之间的转换
+ * 声卡一般工作在48kHz立体声s16，Opus使用单声道float，
+ * 这里负责声道混合、格式转换和采样率转换。
+ * 采样率转换使用多相加窗sinc(Kaiser窗)FIR低通，截止频率取输入、输出中较低的奈奎斯特频率的85%，
+ * 降采样(包括44.1kHz这类非整数倍)时先滤除新奈奎斯特频率以上的成分，不会混叠到语音频带。
+ * 系数表按AUDIO_RESAMPLER_PHASES个相位预先计算，相位之间线性插值，
+ * 因此固定比例与变比(用于时钟漂移补偿)走同一条路径，每个输出样本的计算量固定为taps次乘加。
+ * 循环都写成可以被编译器自动向量化的形式，不依赖具体的指令集。
+ */
+
+#define AUDIO_RESAMPLER_PHASES   64
+#define AUDIO_RESAMPLER_MAX_TAPS 64
+
+typedef struct
+{
+    int      in_rate;
+    int      out_rate;
+    int      taps;          /* 每个输出样本的FIR长度，8的倍数 */
+    int      variable;      /* 设置过变比后不再走直接复制的路径 */
+    uint32_t base_step;     /* 16.16定点，in_rate/out_rate */
+    uint32_t step;          /* 16.16定点，每个输出样本前进的输入样本数 */
+    uint64_t pos;           /* 16.16定点，下一个输出样本在 hist[0..taps-1], in[0..] 中的位置 */
+    float    hist[AUDIO_RESAMPLER_MAX_TAPS];    /* 上一块的最后taps个样本 */
+    float    coeffs[(AUDIO_RESAMPLER_PHASES + 1) * AUDIO_RESAMPLER_MAX_TAPS];
+} AudioResampler;
+
+void AudioResamplerInit (AudioResampler *resampler,
+                         int             in_rate,
+                         int             out_rate);
+void AudioResamplerSetRatio (AudioResampler *resampler,
+                             double          ratio);
+int AudioResamplerMaxOutput (const AudioResampler *resampler,
+                             int                   in_frames);
+int AudioResample (AudioResampler *resampler,
+                   const float    *in,
+                   int             in_frames,
+                   float          *out);
+
+void AudioDownmixS16 (const int16_t *in,
+                      int            frames,
+                      int            channels,
+                      float         *out);
+void AudioDownmixF32 (const float *in,
+                      int          frames,
+                      int          channels,
+                      float       *out);
+void AudioUpmixS16 (const float *in,
+                    int          frames,
+                    int          channels,
+                    int16_t     *out);
+void AudioUpmixF32 (const float *in,
+                    int          frames,
+                    int          channels,
+                    float       *out);
+
+#endif
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include <opus.h>
+#include "audio_resample.h"
+
+/*
+ * 离线测量ws_util中Opus编解码路径的开销
+ * 与CaptAudio/PlayAudio相同：单声道float，OPUS_APPLICATION_VOIP编码，
+ * 解码器按放音声卡的采样率输出，打开FEC时预期丢包率与UDP旁路相同(5%)
+ * 在采样率、帧长、复杂度、码率、FEC、DTX的组合上各跑一遍，
+ * 每个组合输出一行JSON到标准输出，便于在不同版本之间对比；
+ * 标准错误输出便于阅读的表格。
+ * 编译命令：make bench_opus
+ * 用法：bench_opus [--input=FILE] [--seconds=N] [--repeat=N] [--decode-rate=HZ]
+ *                  [--rates=16000,48000] [--frames=10,20,40,60] [--complexity=0,5,10]
+ *                  [--bitrates=0,24000] [--fec=0,1] [--dtx=0,1]
+ * --input为48kHz单声道s16原始数据，不指定时使用合成的类语音信号；
+ * 复杂度-1表示不设置(libopus的默认值)，码率0表示OPUS_AUTO
+ */
+
+#define MAX_PACKET      4000
+#define MAX_LIST        16
+#define REFERENCE_RATE  48000
+#define LOSS_PERC       5
+#define SILENT_PACKET   8
+
+/*
+ * ConnectionInit中的设置(复杂度和码率用默认值，打开FEC，不用DTX)，输出中标记为"current"
+ */
+#define CURRENT_RATE     16000
+#define CURRENT_FRAME_MS 20
+
+typedef struct
+{
+    int count;
+    int value[MAX_LIST];
+} IntList;
+
+static IntList rates      = { 2, { 16000, 48000 } };
+static IntList frames_ms  = { 4, { 10, 20, 40, 60 } };
+static IntList complexity = { 4, { -1, 0, 5, 10 } };
+static IntList bitrates   = { 2, { 0, 24000 } };
+static IntList fec        = { 2, { 0, 1 } };
+static IntList dtx        = { 2, { 0, 1 } };
+static int     seconds    = 10;
+static int     repeat     = 3;
+static int     decode_rate = 48000;
+static const char *input  = NULL;
+
+/*
+ * 统计计时区间内的内存分配次数
+ * 编解码的每一帧都不应分配内存，升级libopus后这里不为0说明行为变了
+ */
+static int  counting = 0;
+static long allocs   = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *malloc (size_t size)
+{
+    if (counting)
+        allocs++;
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t count,
+              size_t size)
+{
+    if (counting)
+        allocs++;
+    return __libc_calloc (count,
+                          size);
+}
+
+void *realloc (void   *ptr,
+               size_t  size)
+{
+    if (counting)
+        allocs++;
+    return __libc_realloc (ptr,
+                           size);
+}
+#define ALLOCS(n) (n)
+#else
+#define ALLOCS(n) (-1L)
+#endif
+
+static double Now ()
+{
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int ParseList (const char *text,
+                      IntList    *list)
+{
+    list->count = 0;
+    while (*text
+        && list->count < MAX_LIST)
+    {
+        char *end;
+        list->value[list->count++] = (int)strtol (text,
+                                                  &end,
+                                                  10);
+        if (end == text)
+            return 0;
+        text = *end == ',' ? end + 1 : end;
+    }
+    return list->count > 0;
+}
+
+/*
+ * 合成的参考信号：浊音段(基频滑动的谐波加共振峰包络)、清音段(噪声)和静音段交替，
+ * 静音段用于观察DTX和发送端的静音抑制
+ */
+static float *Synthesize (int rate,
+                          int length)
+{
+    float        *pcm   = malloc (length * sizeof (float));
+    unsigned int  noise = 12345;
+    double        phase = 0;
+    for (int i = 0; i < length; i++)
+    {
+        double t       = (double)i / rate;
+        double segment = fmod (t, 2.0);
+        float  v       = 0;
+        if (segment < 1.2)
+        {
+            double f0 = 120 + 40 * sin (2 * M_PI * 0.7 * t);
+            phase += 2 * M_PI * f0 / rate;
+            for (int h = 1; h * f0 < rate / 2 && h <= 30; h++)
+            {
+                double f   = h * f0;
+                double env = exp (-pow ((f - 700) / 400, 2))
+                           + 0.5 * exp (-pow ((f - 1200) / 500, 2))
+                           + 0.2 * exp (-pow ((f - 2600) / 800, 2));
+                v += (float)(env * sin (h * phase) / h);
+            }
+            v *= (float)(0.4 * (0.6 + 0.4 * sin (2 * M_PI * 3 * t)));
+        }
+        else if (segment < 1.5)
+        {
+            noise = noise * 1103515245 + 12345;
+            v = (float)(((noise >> 16) & 0x7fff) / 32768.0 - 0.5) * 0.1f;
+        }
+        pcm[i] = v;
+    }
+    return pcm;
+}
+
+/*
+ * 读入48kHz单声道s16，经与采音相同的AudioResample转换到编码器采样率
+ */
+static float *LoadInput (int  rate,
+                         int *length)
+{
+    FILE *file = fopen (input, "rb");
+    if (!file)
+    {
+        perror (input);
+        return NULL;
+    }
+    fseek (file, 0, SEEK_END);
+    long size = ftell (file);
+    fseek (file, 0, SEEK_SET);
+    int      count = (int)(size / sizeof (int16_t));
+    int16_t *raw   = malloc (count * sizeof (int16_t));
+    float   *mono  = malloc (count * sizeof (float));
+    count = (int)fread (raw, sizeof (int16_t), count, file);
+    fclose (file);
+    AudioDownmixS16 (raw,
+                     count,
+                     1,
+                     mono);
+
+    AudioResampler resampler;
+    AudioResamplerInit (&resampler,
+                        REFERENCE_RATE,
+                        rate);
+    float *pcm = malloc (AudioResamplerMaxOutput (&resampler, count) * sizeof (float));
+    *length = AudioResample (&resampler,
+                             mono,
+                             count,
+                             pcm);
+    free (mono);
+    free (raw);
+    return pcm;
+}
+
+static int CompareInt (const void *a,
+                       const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static void RunOne (const float *pcm,
+                    int          length,
+                    int          rate,
+                    int          frame_ms,
+                    int          cplx,
+                    int          bitrate,
+                    int          use_fec,
+                    int          use_dtx)
+{
+    int    frame      = rate * frame_ms / 1000;
+    int    count      = length / frame;
+    int    out_frame  = decode_rate * frame_ms / 1000;
+    int    error;
+    unsigned char *packets = malloc ((size_t)count * MAX_PACKET);
+    int   *sizes      = malloc (count * sizeof (int));
+    float *decoded    = malloc (decode_rate / 1000 * 120 * sizeof (float));
+    double encode_ns  = 0;
+    double decode_ns  = 0;
+    long   enc_allocs = 0;
+    long   dec_allocs = 0;
+    opus_int32 actual = cplx;
+
+    for (int r = 0; r < repeat; r++)
+    {
+        OpusEncoder *encoder = opus_encoder_create (rate,
+                                                    1,
+                                                    OPUS_APPLICATION_VOIP,
+                                                   &error);
+        OpusDecoder *decoder = opus_decoder_create (decode_rate,
+                                                    1,
+                                                   &error);
+        if (cplx >= 0)
+            opus_encoder_ctl (encoder,
+                              OPUS_SET_COMPLEXITY (cplx));
+        opus_encoder_ctl (encoder,
+                          OPUS_GET_COMPLEXITY (&actual));
+        opus_encoder_ctl (encoder,
+                          OPUS_SET_BITRATE (bitrate ? bitrate : OPUS_AUTO));
+        opus_encoder_ctl (encoder,
+                          OPUS_SET_INBAND_FEC (use_fec));
+        if (use_fec)
+            opus_encoder_ctl (encoder,
+                              OPUS_SET_PACKET_LOSS_PERC (LOSS_PERC));
+        opus_encoder_ctl (encoder,
+                          OPUS_SET_DTX (use_dtx));
+
+        allocs = 0;
+        counting = 1;
+        double start = Now ();
+        for (int i = 0; i < count; i++)
+            sizes[i] = opus_encode_float (encoder,
+                                          pcm + (size_t)i * frame,
+                                          frame,
+                                          packets + (size_t)i * MAX_PACKET,
+                                          MAX_PACKET);
+        double elapsed = Now () - start;
+        counting = 0;
+        if (r == 0 || elapsed < encode_ns)
+            encode_ns = elapsed;
+        enc_allocs = allocs;
+
+/*
+ * 与PlayAudio一样，静音抑制掉的包不交给解码器
+ */
+        allocs = 0;
+        counting = 1;
+        start = Now ();
+        for (int i = 0; i < count; i++)
+            if (sizes[i] > SILENT_PACKET)
+                opus_decode_float (decoder,
+                                   packets + (size_t)i * MAX_PACKET,
+                                   sizes[i],
+                                   decoded,
+                                   out_frame,
+                                   0);
+        elapsed = Now () - start;
+        counting = 0;
+        if (r == 0 || elapsed < decode_ns)
+            decode_ns = elapsed;
+        dec_allocs = allocs;
+
+        opus_decoder_destroy (decoder);
+        opus_encoder_destroy (encoder);
+    }
+
+    long total = 0;
+    int  sent  = 0;
+    for (int i = 0; i < count; i++)
+        if (sizes[i] > SILENT_PACKET)
+        {
+            total += sizes[i];
+            sent++;
+        }
+    qsort (sizes, count, sizeof (int), CompareInt);
+    double duration = (double)count * frame / rate;
+    double realtime = duration * 1e9 / (encode_ns + decode_ns);
+    int    current  = rate == CURRENT_RATE
+                   && frame_ms == CURRENT_FRAME_MS
+                   && cplx < 0
+                   && bitrate == 0
+                   && use_fec
+                   && !use_dtx;
+
+    printf ("{\"rate\":%d,\"frame_ms\":%d,\"complexity\":%d,\"complexity_default\":%s,\"bitrate\":%d,\"fec\":%d,\"dtx\":%d,"
+            "\"decode_rate\":%d,\"frames\":%d,\"encode_ns\":%.0f,\"decode_ns\":%.0f,\"realtime\":%.1f,"
+            "\"bytes_min\":%d,\"bytes_median\":%d,\"bytes_p95\":%d,\"bytes_max\":%d,"
+            "\"sent\":%d,\"kbps\":%.2f,\"encode_allocs\":%ld,\"decode_allocs\":%ld,\"current\":%s}\n",
+            rate,
+            frame_ms,
+            actual,
+            cplx < 0 ? "true" : "false",
+            bitrate,
+            use_fec,
+            use_dtx,
+            decode_rate,
+            count,
+            encode_ns / count,
+            decode_ns / count,
+            realtime,
+            sizes[0],
+            sizes[count / 2],
+            sizes[count * 95 / 100],
+            sizes[count - 1],
+            sent,
+            total * 8 / duration / 1000,
+            ALLOCS (enc_allocs),
+            ALLOCS (dec_allocs),
+            current ? "true" : "false");
+    char bitrate_text[16];
+    snprintf (bitrate_text,
+              sizeof (bitrate_text),
+              bitrate ? "%d" : "auto",
+              bitrate);
+    fprintf (stderr,
+             "%6d %3d ms c%-2d %6s fec%d dtx%d  enc %8.0f ns  dec %8.0f ns  x%-7.1f %6.2f kbps  %4d/%4d/%4d B%s\n",
+             rate,
+             frame_ms,
+             actual,
+             bitrate_text,
+             use_fec,
+             use_dtx,
+             encode_ns / count,
+             decode_ns / count,
+             realtime,
+             total * 8 / duration / 1000,
+             sizes[0],
+             sizes[count / 2],
+             sizes[count - 1],
+             current ? "  *" : "");
+
+    free (decoded);
+    free (sizes);
+    free (packets);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        int ok = 1;
+        if (strncmp (arg, "--input=", 8) == 0)
+            input = arg + 8;
+        else if (strncmp (arg, "--seconds=", 10) == 0)
+            ok = (seconds = atoi (arg + 10)) > 0;
+        else if (strncmp (arg, "--repeat=", 9) == 0)
+            ok = (repeat = atoi (arg + 9)) > 0;
+        else if (strncmp (arg, "--decode-rate=", 14) == 0)
+            ok = (decode_rate = atoi (arg + 14)) > 0;
+        else if (strncmp (arg, "--rates=", 8) == 0)
+            ok = ParseList (arg + 8, &rates);
+        else if (strncmp (arg, "--frames=", 9) == 0)
+            ok = ParseList (arg + 9, &frames_ms);
+        else if (strncmp (arg, "--complexity=", 13) == 0)
+            ok = ParseList (arg + 13, &complexity);
+        else if (strncmp (arg, "--bitrates=", 11) == 0)
+            ok = ParseList (arg + 11, &bitrates);
+        else if (strncmp (arg, "--fec=", 6) == 0)
+            ok = ParseList (arg + 6, &fec);
+        else if (strncmp (arg, "--dtx=", 6) == 0)
+            ok = ParseList (arg + 6, &dtx);
+        else
+            ok = 0;
+        if (!ok)
+        {
+            fprintf (stderr,
+                     "Unknown or invalid option: %s\n",
+                     arg);
+            return -1;
+        }
+    }
+
+/*
+ * 第一行记录环境，对比不同版本的结果时先看这一行
+ */
+    struct utsname machine;
+    uname (&machine);
+    OpusEncoder *probe = opus_encoder_create (CURRENT_RATE,
+                                              1,
+                                              OPUS_APPLICATION_VOIP,
+                                              NULL);
+    opus_int32 default_complexity = 0;
+    opus_encoder_ctl (probe,
+                      OPUS_GET_COMPLEXITY (&default_complexity));
+    opus_encoder_destroy (probe);
+    printf ("{\"opus\":\"%s\",\"machine\":\"%s\",\"input\":\"%s\",\"seconds\":%d,\"repeat\":%d,\"default_complexity\":%d}\n",
+            opus_get_version_string (),
+            machine.machine,
+            input ? input : "synthetic",
+            seconds,
+            repeat,
+            default_complexity);
+    fprintf (stderr,
+             "%s on %s, %s input, best of %d\n",
+             opus_get_version_string (),
+             machine.machine,
+             input ? input : "synthetic",
+             repeat);
+
+    for (int a = 0; a < rates.count; a++)
+    {
+        int    rate   = rates.value[a];
+        int    length = rate * seconds;
+        float *pcm    = input ? LoadInput (rate,
+                                          &length)
+                              : Synthesize (rate,
+                                            length);
+        if (!pcm)
+            return -1;
+        for (int b = 0; b < frames_ms.count; b++)
+            for (int c = 0; c < complexity.count; c++)
+                for (int d = 0; d < bitrates.count; d++)
+                    for (int e = 0; e < fec.count; e++)
+                        for (int f = 0; f < dtx.count; f++)
+                            if (length / (rate * frames_ms.value[b] / 1000) > 0)
+                                RunOne (pcm,
+                                        length,
+                                        rate,
+                                        frames_ms.value[b],
+                                        complexity.value[c],
+                                        bitrates.value[d],
+                                        fec.value[e],
+                                        dtx.value[f]);
+        free (pcm);
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "audio_resample.h"
+
+/*
+ * 测量ws_util中声卡格式转换路径每20ms的开销
+ * 采音：声卡立体声s16 -> 单声道float -> 16kHz
+ * 放音：16kHz单声道float -> 声卡采样率 -> 立体声s16
+ * 分别测量48kHz(整数倍)、44.1kHz(非整数倍)以及放音时设置了漂移补偿变比的情况
+ * 编译命令：make bench_resample
+ */
+
+#define CODEC_RATE  16000
+#define CHANNELS    2
+#define ROUNDS      20000
+
+static double Now (void)
+{
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/*
+ * 返回两个方向的输出样本数之和，防止循环被优化掉
+ */
+static int BenchRate (int    device_rate,
+                      double ratio)
+{
+    int device_frames = device_rate / 50;
+    int codec_frames  = CODEC_RATE / 50;
+
+    AudioResampler down;
+    AudioResampler up;
+    AudioResamplerInit (&down,
+                        device_rate,
+                        CODEC_RATE);
+    AudioResamplerInit (&up,
+                        CODEC_RATE,
+                        device_rate);
+    if (ratio != 1.0)
+        AudioResamplerSetRatio (&up,
+                                ratio);
+    int      max_out     = AudioResamplerMaxOutput (&up, codec_frames);
+    int16_t *device      = malloc ((device_frames > max_out ? device_frames : max_out) * CHANNELS * sizeof (int16_t));
+    float   *mono        = malloc (device_frames * sizeof (float));
+    float   *codec       = malloc (AudioResamplerMaxOutput (&down, device_frames) * sizeof (float));
+    float   *device_mono = malloc (max_out * sizeof (float));
+    for (int i = 0; i < device_frames; i++)
+        for (int c = 0; c < CHANNELS; c++)
+            device[i * CHANNELS + c] = (int16_t)(8000 * sin (2 * M_PI * 440 * i / device_rate));
+    for (int i = 0; i < codec_frames; i++)
+        codec[i] = 0.25f * sin (2 * M_PI * 440 * i / CODEC_RATE);
+
+    double start = Now ();
+    int    count = 0;
+    if (ratio == 1.0)
+    {
+        for (int r = 0; r < ROUNDS; r++)
+        {
+            AudioDownmixS16 (device,
+                             device_frames,
+                             CHANNELS,
+                             mono);
+            count += AudioResample (&down,
+                                    mono,
+                                    device_frames,
+                                    device_mono);
+        }
+        printf ("capture  %d Hz x%d s16 -> %d Hz mono (%2d taps): %8.0f ns / 20 ms\n",
+                device_rate,
+                CHANNELS,
+                CODEC_RATE,
+                down.taps,
+                (Now () - start) / ROUNDS);
+    }
+
+    start = Now ();
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        int n = AudioResample (&up,
+                               codec,
+                               codec_frames,
+                               device_mono);
+        AudioUpmixS16 (device_mono,
+                       n,
+                       CHANNELS,
+                       device);
+        count += n;
+    }
+    printf ("playback %d Hz mono -> %d Hz x%d s16 (%2d taps)%s: %8.0f ns / 20 ms\n",
+            CODEC_RATE,
+            device_rate,
+            CHANNELS,
+            up.taps,
+            ratio != 1.0 ? " drift" : "",
+            (Now () - start) / ROUNDS);
+
+    free (device_mono);
+    free (codec);
+    free (mono);
+    free (device);
+    return count;
+}
+
+int main (void)
+{
+    int count = 0;
+    count += BenchRate (48000,
+                        1.0);
+    count += BenchRate (44100,
+                        1.0);
+    count += BenchRate (48000,
+                        1.001);
+    printf ("(%d samples)\n",
+            count);
+    return 0;
+}
@@ -0,0 +1,381 @@
+#include <string.h>
+#include <opus.h>
+#include <libsoup/soup.h>
+#include "ws_util.h"
+#include "trace.h"
+#include "log_util.h"
+#include "broadcast.h"
+
+/*
+ * 每页5个包(100ms)，积压超过1秒跳过
+ */
+#define BROADCAST_PAGE_PACKETS  5
+#define BROADCAST_MAX_PENDING   10
+#define BROADCAST_MAX_PACKET    4000
+#define OPUS_INPUT_RATE         16000
+#define OGG_HEADER              27
+
+typedef struct
+{
+    SoupServer  *server;
+    SoupMessage *msg;
+    guint        pending;
+} BroadcastListener;
+
+/*
+ * 从声卡线程交给主循环的页，generation用于丢弃已停止的流留下的页
+ */
+typedef struct
+{
+    GBytes *data;
+    guint   generation;
+} BroadcastPage;
+
+static GList          *listeners  = NULL;
+static GBytes         *headers    = NULL;
+static guint           generation = 0;
+static BroadcastStats  stats;
+static guint32         crc_table[256];
+
+/*
+ * 以下只在声卡线程中访问(开始新的流时采音回调尚未安装)
+ */
+static guint32 serial;
+static guint32 sequence;
+static gint64  granule;
+static int     packets;
+static int     segments;
+static gsize   fill;
+static guint8  lacing[255];
+static guint8  body[BROADCAST_PAGE_PACKETS * BROADCAST_MAX_PACKET];
+
+/*
+ * Ogg的CRC：多项式0x04c11db7，不反转，初值为0
+ */
+static void OggCrcInit (void)
+{
+    for (guint32 i = 0; i < 256; i++)
+    {
+        guint32 r = i << 24;
+        for (int j = 0; j < 8; j++)
+            r = r & 0x80000000 ? (r << 1) ^ 0x04c11db7 : r << 1;
+        crc_table[i] = r;
+    }
+}
+
+static void WriteLe32 (guint8  *p,
+                       guint32  value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static GBytes *OggPage (guint8        flags,
+                        gint64        position,
+                        const guint8 *segment_table,
+                        int           count,
+                        const guint8 *data,
+                        gsize         size)
+{
+    gsize   length = OGG_HEADER + count + size;
+    guint8 *page   = g_malloc (length);
+    memcpy (page,
+            "OggS",
+            4);
+    page[4] = 0;
+    page[5] = flags;
+    WriteLe32 (page + 6,
+               (guint64)position);
+    WriteLe32 (page + 10,
+               (guint64)position >> 32);
+    WriteLe32 (page + 14,
+               serial);
+    WriteLe32 (page + 18,
+               sequence++);
+    WriteLe32 (page + 22,
+               0);
+    page[26] = count;
+    memcpy (page + OGG_HEADER,
+            segment_table,
+            count);
+    memcpy (page + OGG_HEADER + count,
+            data,
+            size);
+    guint32 crc = 0;
+    for (gsize i = 0; i < length; i++)
+        crc = (crc << 8) ^ crc_table[(crc >> 24) ^ page[i]];
+    WriteLe32 (page + 22,
+               crc);
+    return g_bytes_new_take (page,
+                             length);
+}
+
+/*
+ * OpusHead和OpusTags各占一页，每个收听者先收到这两页
+ * 中途加入的收听者之后收到的页序号不连续，解码器把它当作丢页处理
+ */
+static GBytes *BroadcastHeaders (int pre_skip)
+{
+    guint8 head[19];
+    memcpy (head,
+            "OpusHead",
+            8);
+    head[8] = 1;
+    head[9] = 1;
+    head[10] = pre_skip;
+    head[11] = pre_skip >> 8;
+    WriteLe32 (head + 12,
+               OPUS_INPUT_RATE);
+    head[16] = 0;
+    head[17] = 0;
+    head[18] = 0;
+
+    const char *vendor = opus_get_version_string ();
+    gsize       length = strlen (vendor);
+    gsize       size   = 8 + 4 + length + 4;
+    guint8     *tags   = g_malloc (size);
+    memcpy (tags,
+            "OpusTags",
+            8);
+    WriteLe32 (tags + 8,
+               length);
+    memcpy (tags + 12,
+            vendor,
+            length);
+    WriteLe32 (tags + 12 + length,
+               0);
+
+    guint8 table[255];
+    int    count = 0;
+    for (gsize left = size; ; left -= 255)
+    {
+        table[count++] = MIN (left, 255);
+        if (left < 255)
+            break;
+    }
+    guint8  one    = sizeof (head);
+    GBytes *first  = OggPage (0x02,
+                              0,
+                             &one,
+                              1,
+                              head,
+                              sizeof (head));
+    GBytes *second = OggPage (0,
+                              0,
+                              table,
+                              count,
+                              tags,
+                              size);
+    g_free (tags);
+
+    GByteArray *both = g_byte_array_new ();
+    g_byte_array_append (both,
+                         g_bytes_get_data (first, NULL),
+                         g_bytes_get_size (first));
+    g_byte_array_append (both,
+                         g_bytes_get_data (second, NULL),
+                         g_bytes_get_size (second));
+    g_bytes_unref (first);
+    g_bytes_unref (second);
+    return g_byte_array_free_to_bytes (both);
+}
+
+static void BroadcastPageFree (gpointer data)
+{
+    BroadcastPage *page = (BroadcastPage *)data;
+    g_bytes_unref (page->data);
+    g_free (page);
+}
+
+/*
+ * 各收听者的SoupBuffer共享同一个GBytes，不复制页的内容
+ */
+static void BroadcastAppend (BroadcastListener *listener,
+                             GBytes            *data)
+{
+    gsize         size;
+    gconstpointer bytes  = g_bytes_get_data (data,
+                                            &size);
+    SoupBuffer   *buffer = soup_buffer_new_with_owner (bytes,
+                                                       size,
+                                                       g_bytes_ref (data),
+                                                       (GDestroyNotify)g_bytes_unref);
+    soup_message_body_append_buffer (listener->msg->response_body,
+                                     buffer);
+    soup_buffer_free (buffer);
+    listener->pending++;
+}
+
+/*
+ * 在主循环中把一页分发给所有收听者
+ */
+static gboolean BroadcastPublish (gpointer user_data)
+{
+    BroadcastPage *page = (BroadcastPage *)user_data;
+    if (page->generation != generation)
+        return G_SOURCE_REMOVE;
+    TraceSpan span = TraceBegin ("broadcast.publish");
+    stats.pages++;
+    stats.bytes += g_bytes_get_size (page->data);
+    for (GList *l = listeners; l; l = l->next)
+    {
+        BroadcastListener *listener = (BroadcastListener *)l->data;
+        if (listener->pending >= BROADCAST_MAX_PENDING)
+        {
+            stats.skipped++;
+            continue;
+        }
+        BroadcastAppend (listener,
+                         page->data);
+        soup_server_unpause_message (listener->server,
+                                     listener->msg);
+        stats.sent++;
+    }
+    TraceEnd (&span);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * 采音回调(声卡线程)：凑满一页后交给主循环
+ */
+static void BroadcastTap (const unsigned char *packet,
+                          int                  size,
+                          gpointer             user_data)
+{
+    for (int left = size; ; left -= 255)
+    {
+        lacing[segments++] = MIN (left, 255);
+        if (left < 255)
+            break;
+    }
+    memcpy (body + fill,
+            packet,
+            size);
+    fill += size;
+    granule += opus_packet_get_nb_samples (packet,
+                                           size,
+                                           48000);
+    if (++packets < BROADCAST_PAGE_PACKETS)
+        return;
+
+    BroadcastPage *page = g_new (BroadcastPage, 1);
+    page->data = OggPage (0,
+                          granule,
+                          lacing,
+                          segments,
+                          body,
+                          fill);
+    page->generation = GPOINTER_TO_UINT (user_data);
+    packets = 0;
+    segments = 0;
+    fill = 0;
+    g_main_context_invoke_full (g_main_context_default (),
+                                G_PRIORITY_DEFAULT,
+                                BroadcastPublish,
+                                page,
+                                BroadcastPageFree);
+}
+
+static gboolean BroadcastStart (const char *capture_device)
+{
+    if (!CaptureAcquire (capture_device))
+        return FALSE;
+    if (!crc_table[1])
+        OggCrcInit ();
+    generation++;
+    serial = g_random_int ();
+    sequence = 0;
+    granule = 0;
+    packets = 0;
+    segments = 0;
+    fill = 0;
+    headers = BroadcastHeaders (CaptureLookahead ());
+    CaptureSetTap (BroadcastTap,
+                   GUINT_TO_POINTER (generation));
+    LOG_INFO ("开始广播。");
+    return TRUE;
+}
+
+static void BroadcastStop (void)
+{
+    CaptureSetTap (NULL,
+                   NULL);
+    CaptureRelease ();
+    g_clear_pointer (&headers,
+                     g_bytes_unref);
+    generation++;
+    LOG_INFO ("停止广播。");
+}
+
+static void BroadcastWroteChunk (SoupMessage *msg,
+                                 gpointer     user_data)
+{
+    BroadcastListener *listener = (BroadcastListener *)user_data;
+    if (listener->pending)
+        listener->pending--;
+}
+
+static void BroadcastFinished (SoupMessage *msg,
+                               gpointer     user_data)
+{
+    BroadcastListener *listener = (BroadcastListener *)user_data;
+    g_signal_handlers_disconnect_by_data (msg,
+                                          listener);
+    listeners = g_list_remove (listeners,
+                               listener);
+    stats.listeners--;
+    g_free (listener);
+    if (!listeners)
+        BroadcastStop ();
+}
+
+gboolean BroadcastAttach (SoupServer  *server,
+                          SoupMessage *msg,
+                          const char  *capture_device)
+{
+    if (!listeners
+    && !BroadcastStart (capture_device))
+        return FALSE;
+
+    soup_message_set_status (msg,
+                             SOUP_STATUS_OK);
+    soup_message_headers_set_encoding (msg->response_headers,
+                                       SOUP_ENCODING_CHUNKED);
+    soup_message_headers_set_content_type (msg->response_headers,
+                                           "audio/ogg",
+                                           NULL);
+    soup_message_headers_replace (msg->response_headers,
+                                  "Cache-Control",
+                                  "no-cache");
+/*
+ * 写出的页不保留在应答体中
+ */
+    soup_message_body_set_accumulate (msg->response_body,
+                                      FALSE);
+
+    BroadcastListener *listener = g_new0 (BroadcastListener, 1);
+    listener->server = server;
+    listener->msg = msg;
+    listeners = g_list_prepend (listeners,
+                                listener);
+    stats.listeners++;
+    stats.max_listeners = MAX (stats.max_listeners, stats.listeners);
+    g_signal_connect (msg,
+                      "wrote-chunk",
+                      G_CALLBACK (BroadcastWroteChunk),
+                      listener);
+    g_signal_connect (msg,
+                      "finished",
+                      G_CALLBACK (BroadcastFinished),
+                      listener);
+    BroadcastAppend (listener,
+                     headers);
+    return TRUE;
+}
+
+void BroadcastGetStats (BroadcastStats *stats_out)
+{
+    *stats_out = stats;
+}
@@ -0,0 +1,33 @@
+#ifndef _BROADCAST_H
+#define _BROADCAST_H
+
+#include <libsoup/soup.h>
+
+/*
+ * 采音广播
+ * 采音回调中编码出的Opus包每BROADCAST_PAGE_PACKETS个组成一个Ogg页，页只生成一次，
+ * 在主循环中以引用的方式追加到所有收听者的chunked应答中。
+ * 收听者积压的页超过BROADCAST_MAX_PENDING时不再追加，追上后直接从最新的页继续。
+ * 第一个收听者打开采音设备，最后一个收听者离开时释放。
+ * 所有函数都只能在主循环中调用。
+ */
+
+typedef struct
+{
+    guint   listeners;
+    guint   max_listeners;
+    guint   pages;
+    guint64 bytes;
+    guint64 sent;
+    guint64 skipped;
+} BroadcastStats;
+
+/*
+ * 设置应答头并把msg加入收听者，无法打开采音设备时返回FALSE
+ */
+gboolean BroadcastAttach (SoupServer  *server,
+                          SoupMessage *msg,
+                          const char  *capture_device);
+void BroadcastGetStats (BroadcastStats *stats);
+
+#endif
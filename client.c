@@ -3,38 +3,170 @@
 #include <opus.h>
 #include <SDL2/SDL.h>
 #include "ws_util.h"
+#include "uds_util.h"
+#include "sock_util.h"
+#include "udp_util.h"
+#include "log_util.h"
 
 /*
  * 一个基于LibSoup的Web Client例子
  * 参考：https://libsoup.org/libsoup-2.4/libsoup-client-howto.html
  * 编译命令：编译命令：cc -o client client.c `pkg-config --cflags --libs libsoup-2.4`
+ * 指定--socket时所有请求都通过Unix域套接字发送，否则通过TCP连接--server
  */
 
-void DoGet()
+#define DEFAULT_SERVER "http://172.16.1.53:1080"
+#define BENCH_SERVER   "http://127.0.0.1:1080"
+#define DEFAULT_SOCKET "/tmp/soup_example.sock"
+#define BENCH_TLS_PORT 1443
+#define BENCH_FRAME    60
+#define BENCH_BULK     2
+
+static gchar   *server_uri    = NULL;
+static gchar   *server_socket = NULL;
+static gboolean insecure      = FALSE;
+static gchar   *log_name      = NULL;
+
+static GOptionEntry entries[] =
+{
+    { "server", 's', 0, G_OPTION_ARG_STRING, &server_uri,
+      "服务器地址，默认为" DEFAULT_SERVER, "URL" },
+    { "socket", 'u', 0, G_OPTION_ARG_FILENAME, &server_socket,
+      "通过Unix域套接字连接服务器", "PATH" },
+    { "insecure", 'k', 0, G_OPTION_ARG_NONE, &insecure,
+      "https/wss时不验证服务器证书(自签名证书)", NULL },
+    { "busy-poll", 0, 0, G_OPTION_ARG_INT, &sock_profile_audio.busy_poll,
+      "音频连接的SO_BUSY_POLL(微秒)，默认不启用", "USEC" },
+    { "no-sock-tuning", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &sock_tuning,
+      "不设置任何套接字参数", NULL },
+    { "no-udp", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &udp_enabled,
+      "音频只走WebSocket，不协商UDP旁路", NULL },
+    { "udp-loss", 0, 0, G_OPTION_ARG_DOUBLE, &udp_emulate_loss,
+      "模拟UDP丢包率(百分比)，用于回环测试", "PERCENT" },
+    { "udp-delay", 0, 0, G_OPTION_ARG_INT, &udp_emulate_delay,
+      "模拟UDP延迟(毫秒)，用于回环测试", "MS" },
+    { "log-level", 0, 0, G_OPTION_ARG_STRING, &log_name,
+      "日志级别：error、warning、info(默认)、debug", "LEVEL" },
+    { NULL }
+};
+
+/*
+ * 同一进程内的SoupSession共享GIO的TLS会话缓存，
+ * 到同一服务器的后续连接会自动恢复TLS会话
+ */
+SoupSession *NewSession ()
+{
+    return soup_session_new_with_options (SOUP_SESSION_SSL_STRICT,
+                                          !insecure,
+                                          NULL);
+}
+
+/*
+ * 返回需要用g_free释放的完整URL
+ */
+gchar *ServerUrl (const char *path)
+{
+    return g_strconcat (server_uri,
+                        path,
+                        NULL);
+}
+
+/*
+ * 与soup_session_send_message相同，指定了--socket时走Unix域套接字
+ */
+guint SendMessage (SoupSession *session,
+                   SoupMessage *msg)
+{
+    if (!server_socket)
+        return soup_session_send_message (session,
+                                          msg);
+    GError *error = NULL;
+    if (!UdsSendMessage (server_socket,
+                         msg,
+                        &error))
+    {
+        fprintf (stderr,
+                 "send request error: %s\n",
+                 error->message);
+        g_error_free (error);
+        error = NULL;
+        soup_message_set_status (msg,
+                                 SOUP_STATUS_IO_ERROR);
+    }
+    return msg->status_code;
+}
+
+/*
+ * 与soup_session_send相同，指定了--socket时走Unix域套接字
+ */
+GInputStream *SendRequest (SoupSession  *session,
+                           SoupMessage  *msg,
+                           GError      **error)
+{
+    if (!server_socket)
+        return soup_session_send (session,
+                                  msg,
+                                  NULL,
+                                  error);
+    return UdsSend (server_socket,
+                    msg,
+                    error);
+}
+
+static void BulkNetworkEvent (SoupMessage        *msg,
+                              GSocketClientEvent  event,
+                              GIOStream          *connection,
+                              gpointer            user_data)
+{
+    if (event != G_SOCKET_CLIENT_CONNECTED
+    || !G_IS_SOCKET_CONNECTION (connection))
+        return;
+    GSocket *socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (connection));
+    SockProfileApply (g_socket_get_fd (socket),
+                      &sock_profile_bulk);
+}
+
+/*
+ * 图片、MJPEG等大流量请求
+ * 连接建立后(TLS握手之前)按bulk设置套接字参数，与服务器端的设置对应
+ * 走Unix域套接字时bulk不设置任何参数，不需要处理
+ */
+SoupMessage *NewBulkMessage (const char *url)
 {
-    SoupSession *session = soup_session_new ();
     SoupMessage *msg = soup_message_new ("GET",
-                                         "http://172.16.1.53:1080/get");
-    guint code = soup_session_send_message (session,
-                                            msg);
+                                         url);
+    g_signal_connect (msg,
+                      "network-event",
+                      G_CALLBACK (BulkNetworkEvent),
+                      NULL);
+    return msg;
+}
+
+void DoGet()
+{
+    SoupSession *session = NewSession ();
+    gchar       *url = ServerUrl ("/get");
+    SoupMessage *msg = NewBulkMessage (url);
+    guint code = SendMessage (session,
+                              msg);
     printf ("response status code: %d\n",
             code);
 
     // clean up
     g_object_unref (msg);
+    g_free (url);
     g_object_unref (session);
 }
 
 void DoImage()
 {
     GError *error = NULL;
-    SoupSession *session = soup_session_new ();
-    SoupMessage *msg = soup_message_new ("GET",
-                                         "http://172.16.1.53:1080/image");
-    GInputStream *stream = soup_session_send(session,
-                                             msg,
-                                             NULL,
-                                            &error);
+    SoupSession *session = NewSession ();
+    gchar       *url = ServerUrl ("/image");
+    SoupMessage *msg = NewBulkMessage (url);
+    GInputStream *stream = SendRequest (session,
+                                        msg,
+                                       &error);
     if (error)
     {
         fprintf (stderr,
@@ -70,6 +202,7 @@ void DoImage()
     }
 err_send:
     g_object_unref (msg);
+    g_free (url);
     g_object_unref (session);
 }
 
@@ -93,21 +226,23 @@ void DoPost(const char *filename)
         goto err_file;
     }
 
-    SoupSession *session = soup_session_new ();
+    SoupSession *session = NewSession ();
+    gchar       *url = ServerUrl ("/post");
     SoupMessage *msg = soup_message_new ("GET",
-                                         "http://172.16.1.53:1080/post");
+                                         url);
     soup_message_set_request (msg,
                               "image/jpeg",
                               SOUP_MEMORY_TAKE,
                               body,
                               length);
-    guint code = soup_session_send_message (session,
-                                            msg);
+    guint code = SendMessage (session,
+                              msg);
     printf ("response status code: %d\n",
             code);
 
     // clean up
     g_object_unref (msg);
+    g_free (url);
     g_object_unref (session);
 err_file:
     return;
@@ -119,13 +254,12 @@ err_file:
 void DoMjpeg ()
 {
     GError *error = NULL;
-    SoupSession *session = soup_session_new ();
-    SoupMessage *msg = soup_message_new ("GET",
-                                         "http://172.16.1.53:1080/mjpeg");
-    GInputStream *stream = soup_session_send(session,
-                                             msg,
-                                             NULL,
-                                            &error);
+    SoupSession *session = NewSession ();
+    gchar       *url = ServerUrl ("/mjpeg");
+    SoupMessage *msg = NewBulkMessage (url);
+    GInputStream *stream = SendRequest (session,
+                                        msg,
+                                       &error);
     if (error)
     {
         fprintf (stderr,
@@ -183,6 +317,7 @@ err_read:
     g_object_unref (stream);
 err_send:
     g_object_unref (msg);
+    g_free (url);
     g_object_unref (session);
 }
 
@@ -199,7 +334,10 @@ void PlayMjpeg (GObject      *source_object,
 {
     MjpegInfo    *info   = (MjpegInfo *)user_data;           
     GError       *error  = NULL;
-    GInputStream *stream = soup_session_send_finish (info->session,
+    GInputStream *stream = server_socket
+                         ? UdsSendFinish (result,
+                                         &error)
+                         : soup_session_send_finish (info->session,
                                                      result,
                                                     &error);
     if (error)
@@ -264,14 +402,22 @@ void DoMjpegAsync()
 {
     MjpegInfo *info  = malloc (sizeof (MjpegInfo));
     GError    *error = NULL;
-    info->session    = soup_session_new ();
-    info->msg        = soup_message_new ("GET",
-                                         "http://172.16.1.53:1080/mjpeg");
-    soup_session_send_async (info->session,
-                             info->msg,
-                             NULL,
-                             PlayMjpeg,
-                             info);
+    gchar     *url   = ServerUrl ("/mjpeg");
+    info->session    = NewSession ();
+    info->msg        = NewBulkMessage (url);
+    g_free (url);
+    if (server_socket)
+        UdsSendAsync (server_socket,
+                      info->msg,
+                      NULL,
+                      PlayMjpeg,
+                      info);
+    else
+        soup_session_send_async (info->session,
+                                 info->msg,
+                                 NULL,
+                                 PlayMjpeg,
+                                 info);
     info->loop = g_main_loop_new (NULL,
                                   TRUE);
     g_main_loop_run(info->loop);
@@ -316,33 +462,636 @@ void DoWs(const char *playback_device,
 {
     SDL_Init (SDL_INIT_AUDIO);
     GError *error = NULL;
-    SoupSession *session = soup_session_new ();
+    SoupSession *session = NewSession ();
+    gchar       *url = ServerUrl ("/ws");
     SoupMessage *msg = soup_message_new ("GET",
-                                         "http://172.16.1.53:1080/ws");
+                                         url);
+    g_free (url);
     WsInfo *info = malloc (sizeof (WsInfo));
     info->playback_device = playback_device;
     info->capture_device = capture_device;
-    soup_session_websocket_connect_async (session,
-                                          msg,
-                                          NULL,
-                                          NULL,
-                                          NULL,
-                                          WsReady,
-                                          info);
+/*
+ * Unix域套接字上的握手是同步完成的，之后同样交给GMainLoop
+ */
+    if (server_socket)
+    {
+        SoupWebsocketConnection *connection = UdsWebsocketConnect (server_socket,
+                                                                   msg,
+                                                                  &error);
+        if (error)
+        {
+            fprintf (stderr,
+                     "get connection error: %s\n",
+                     error->message);
+            g_error_free (error);
+            error = NULL;
+            goto err_connection;
+        }
+        ConnectionInit (connection,
+                        info->playback_device,
+                        info->capture_device);
+        g_object_unref (connection);
+    }
+    else
+        soup_session_websocket_connect_async (session,
+                                              msg,
+                                              NULL,
+                                              NULL,
+                                              NULL,
+                                              WsReady,
+                                              info);
     GMainLoop *loop = g_main_loop_new(NULL,
                                       TRUE);
     g_main_loop_run (loop);
+    g_main_loop_unref (loop);
 
+err_connection:
     free (info);
     printf ("Quit!\n");
     SDL_Quit();
 }
 
+static int CompareDouble (const void *a,
+                          const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * samples为每次请求的耗时(微秒)，会被排序
+ */
+static void ReportLatency (const char *name,
+                           double     *samples,
+                           int         count,
+                           gint64      bytes,
+                           gint64      elapsed)
+{
+    double sum = 0;
+    if (count <= 0)
+        return;
+    qsort (samples,
+           count,
+           sizeof (double),
+           CompareDouble);
+    for (int i = 0; i < count; i++)
+        sum += samples[i];
+    printf ("%-12s mean %8.1f us  p50 %8.1f us  p99 %8.1f us",
+            name,
+            sum / count,
+            samples[count / 2],
+            samples[count * 99 / 100]);
+    if (bytes)
+        printf ("  %8.2f MB/s",
+                bytes / (elapsed / 1000000.0) / (1024 * 1024));
+    puts ("");
+}
+
+/*
+ * 比较TCP回环与Unix域套接字的延迟和吞吐量
+ * 两种方式都是每个请求新建一个连接，服务器需运行在本机
+ */
+void DoBenchUds (int count)
+{
+    const char  *paths[]   = { "/get", "/image" };
+    const char  *path      = server_socket ? server_socket : DEFAULT_SOCKET;
+    SoupSession *session   = NewSession ();
+    double      *samples   = g_new (double, count);
+    for (int p = 0; p < G_N_ELEMENTS (paths); p++)
+    {
+        for (int uds = 0; uds < 2; uds++)
+        {
+            gchar  *url   = g_strconcat (BENCH_SERVER,
+                                         paths[p],
+                                         NULL);
+            gint64  bytes = 0;
+            gint64  begin = g_get_monotonic_time ();
+            for (int i = 0; i < count; i++)
+            {
+                SoupMessage *msg   = soup_message_new ("GET",
+                                                       url);
+                GError      *error = NULL;
+                gint64       start = g_get_monotonic_time ();
+                if (uds)
+                    UdsSendMessage (path,
+                                    msg,
+                                   &error);
+                else
+                {
+                    soup_message_headers_append (msg->request_headers,
+                                                 "Connection",
+                                                 "close");
+                    soup_session_send_message (session,
+                                               msg);
+                }
+                samples[i] = g_get_monotonic_time () - start;
+                if (error)
+                {
+                    fprintf (stderr,
+                             "send request error: %s\n",
+                             error->message);
+                    g_error_free (error);
+                    error = NULL;
+                }
+                bytes += msg->response_body->length;
+                g_object_unref (msg);
+            }
+            gchar *name = g_strconcat (uds ? "uds " : "tcp ",
+                                       paths[p],
+                                       NULL);
+            ReportLatency (name,
+                           samples,
+                           count,
+                           bytes,
+                           g_get_monotonic_time () - begin);
+            g_free (name);
+            g_free (url);
+        }
+    }
+    g_free (samples);
+    g_object_unref (session);
+}
+
+/*
+ * 只有服务器发送了证书(即完整握手)时才会被调用
+ */
+static gboolean AcceptCertificate (GTlsConnection       *connection,
+                                   GTlsCertificate      *certificate,
+                                   GTlsCertificateFlags  errors,
+                                   gpointer              user_data)
+{
+    *(gboolean *)user_data = TRUE;
+    return TRUE;
+}
+
+/*
+ * 建立TLS连接，elapsed返回握手耗时(微秒)
+ * previous不为NULL时从它复制会话状态，进行会话恢复
+ * 服务器身份不同的连接不会命中会话缓存，用来测量完整握手
+ * GIO没有直接报告会话是否恢复的接口，certified返回握手中是否校验了服务器证书：
+ * 自签名证书在完整握手中一定触发accept-certificate，恢复的会话不再发送证书
+ */
+static GIOStream *TlsConnect (GSocketClient  *client,
+                              const char     *identity,
+                              GIOStream      *previous,
+                              gint64         *elapsed,
+                              gboolean       *certified,
+                              GError        **error)
+{
+    *certified = FALSE;
+    GSocketConnection *base = g_socket_client_connect_to_host (client,
+                                                               "127.0.0.1",
+                                                               BENCH_TLS_PORT,
+                                                               NULL,
+                                                               error);
+    if (!base)
+        return NULL;
+    GSocketConnectable *server_identity = g_network_address_new (identity,
+                                                                 BENCH_TLS_PORT);
+    GIOStream *tls = g_tls_client_connection_new (G_IO_STREAM (base),
+                                                  server_identity,
+                                                  error);
+    g_object_unref (server_identity);
+    g_object_unref (base);
+    if (!tls)
+        return NULL;
+    g_signal_connect (tls,
+                      "accept-certificate",
+                      G_CALLBACK (AcceptCertificate),
+                      certified);
+    if (previous)
+        g_tls_client_connection_copy_session_state (G_TLS_CLIENT_CONNECTION (tls),
+                                                    G_TLS_CLIENT_CONNECTION (previous));
+    gint64 start = g_get_monotonic_time ();
+    if (!g_tls_connection_handshake (G_TLS_CONNECTION (tls),
+                                     NULL,
+                                     error))
+    {
+        g_object_unref (tls);
+        return NULL;
+    }
+    *elapsed = g_get_monotonic_time () - start;
+
+/*
+ * TLS 1.3的session ticket在握手之后才发送，完成一次请求以便收到它
+ */
+    const char *request = "GET /get HTTP/1.0\r\nHost: bench\r\n\r\n";
+    char        buffer[1024];
+    if (g_output_stream_write_all (g_io_stream_get_output_stream (tls),
+                                   request,
+                                   strlen (request),
+                                   NULL,
+                                   NULL,
+                                   error))
+        while (g_input_stream_read (g_io_stream_get_input_stream (tls),
+                                    buffer,
+                                    sizeof (buffer),
+                                    NULL,
+                                    NULL) > 0);
+    return tls;
+}
+
+typedef struct
+{
+    GMainLoop               *loop;
+    SoupWebsocketConnection *connection;
+    double                  *samples;
+    int                      count;
+    int                      done;
+    gint64                   sent_at;
+    guchar                   frame[BENCH_FRAME];
+} EchoInfo;
+
+static void EchoMessage (SoupWebsocketConnection *connection,
+                         gint                     type,
+                         GBytes                  *message,
+                         gpointer                 user_data)
+{
+    EchoInfo *info = (EchoInfo *)user_data;
+    info->samples[info->done++] = g_get_monotonic_time () - info->sent_at;
+    if (info->done == info->count)
+    {
+        g_main_loop_quit (info->loop);
+        return;
+    }
+    info->sent_at = g_get_monotonic_time ();
+    soup_websocket_connection_send_binary (connection,
+                                           info->frame,
+                                           BENCH_FRAME);
+}
+
+static void EchoReady (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+    EchoInfo *info  = (EchoInfo *)user_data;
+    GError   *error = NULL;
+    info->connection = soup_session_websocket_connect_finish (SOUP_SESSION (object),
+                                                              result,
+                                                             &error);
+    if (error)
+    {
+        fprintf (stderr,
+                 "get connection error: %s\n",
+                 error->message);
+        g_error_free (error);
+        g_main_loop_quit (info->loop);
+        return;
+    }
+    SockProfileApply (SockStreamFd (soup_websocket_connection_get_io_stream (info->connection)),
+                      &sock_profile_audio);
+    g_signal_connect (info->connection,
+                      "message",
+                      G_CALLBACK (EchoMessage),
+                      info);
+    info->sent_at = g_get_monotonic_time ();
+    soup_websocket_connection_send_binary (info->connection,
+                                           info->frame,
+                                           BENCH_FRAME);
+}
+
+/*
+ * 通过服务器的/echo测量音频帧大小的WebSocket消息的往返时间
+ * 返回完成的次数，samples中为每次的耗时(微秒)
+ */
+int EchoRtt (SoupSession *session,
+             const char  *url,
+             int          count,
+             double      *samples)
+{
+    EchoInfo info;
+    memset (&info, 0, sizeof (info));
+    info.loop    = g_main_loop_new (NULL,
+                                    FALSE);
+    info.samples = samples;
+    info.count   = count;
+    SoupMessage *msg = soup_message_new ("GET",
+                                         url);
+    soup_session_websocket_connect_async (session,
+                                          msg,
+                                          NULL,
+                                          NULL,
+                                          NULL,
+                                          EchoReady,
+                                         &info);
+    g_main_loop_run (info.loop);
+    if (info.connection)
+    {
+        g_signal_handlers_disconnect_by_func (info.connection,
+                                              EchoMessage,
+                                             &info);
+        soup_websocket_connection_close (info.connection,
+                                         SOUP_WEBSOCKET_CLOSE_NORMAL,
+                                         NULL);
+        g_object_unref (info.connection);
+    }
+    g_object_unref (msg);
+    g_main_loop_unref (info.loop);
+    return info.done;
+}
+
+/*
+ * 测量完整握手与会话恢复握手的耗时，以及wss相对ws每帧的额外开销
+ * 服务器需运行在本机，并以--tls-cert启动
+ */
+void DoBenchTls (int count)
+{
+    GSocketClient *client  = g_socket_client_new ();
+    double        *samples = g_new (double, count);
+    GError        *error   = NULL;
+    gint64         begin   = g_get_monotonic_time ();
+    int            done    = 0;
+    int            checked = 0;
+
+    for (; done < count; done++)
+    {
+        gchar     *identity = g_strdup_printf ("full%d.bench",
+                                               done);
+        gint64     elapsed;
+        gboolean   certified;
+        GIOStream *tls = TlsConnect (client,
+                                     identity,
+                                     NULL,
+                                    &elapsed,
+                                    &certified,
+                                    &error);
+        g_free (identity);
+        if (!tls)
+            goto err_handshake;
+        samples[done] = elapsed;
+        checked += certified;
+        g_object_unref (tls);
+    }
+    ReportLatency ("tls full",
+                   samples,
+                   done,
+                   0,
+                   g_get_monotonic_time () - begin);
+
+/*
+ * 完整握手都校验了证书时才能区分恢复与否，只统计确实恢复的握手；
+ * 否则(如证书受信任)无法判断，全部计入并注明未验证
+ */
+    gboolean   verifiable = checked == done;
+    int        resumed    = 0;
+    int        full       = 0;
+    gint64     elapsed;
+    gboolean   certified;
+    GIOStream *previous = TlsConnect (client,
+                                      "resume.bench",
+                                      NULL,
+                                     &elapsed,
+                                     &certified,
+                                     &error);
+    if (!previous)
+        goto err_handshake;
+    begin = g_get_monotonic_time ();
+    for (done = 0; done < count; done++)
+    {
+        GIOStream *tls = TlsConnect (client,
+                                     "resume.bench",
+                                     previous,
+                                    &elapsed,
+                                    &certified,
+                                    &error);
+        if (!tls)
+            break;
+        if (verifiable
+        && certified)
+            full++;
+        else
+            samples[resumed++] = elapsed;
+        g_object_unref (previous);
+        previous = tls;
+    }
+    g_object_unref (previous);
+    if (error)
+        goto err_handshake;
+    if (!verifiable)
+        puts ("tls resumed: 无法确认会话是否恢复(完整握手未校验证书)，以下结果未经验证");
+    else
+        printf ("tls resumed: %d/%d次握手恢复了会话，%d次为完整握手\n",
+                resumed,
+                done,
+                full);
+    if (resumed)
+        ReportLatency ("tls resumed",
+                       samples,
+                       resumed,
+                       0,
+                       g_get_monotonic_time () - begin);
+
+    SoupSession *session = soup_session_new_with_options (SOUP_SESSION_SSL_STRICT,
+                                                          FALSE,
+                                                          NULL);
+    gchar *url = g_strconcat (BENCH_SERVER,
+                              "/echo",
+                              NULL);
+    done = EchoRtt (session,
+                    url,
+                    count,
+                    samples);
+    double ws = 0;
+    for (int i = 0; i < done; i++)
+        ws += samples[i] / done;
+    if (done)
+        ReportLatency ("ws  frame",
+                       samples,
+                       done,
+                       0,
+                       1);
+    g_free (url);
+    url = g_strdup_printf ("https://127.0.0.1:%d/echo",
+                           BENCH_TLS_PORT);
+    done = EchoRtt (session,
+                    url,
+                    count,
+                    samples);
+    double wss = 0;
+    for (int i = 0; i < done; i++)
+        wss += samples[i] / done;
+    if (done)
+    {
+        ReportLatency ("wss frame",
+                       samples,
+                       done,
+                       0,
+                       1);
+        printf ("wss overhead per %d byte frame: %.1f us\n",
+                BENCH_FRAME,
+                wss - ws);
+    }
+    g_free (url);
+    g_object_unref (session);
+    goto out;
+
+err_handshake:
+    fprintf (stderr,
+             "tls handshake error: %s\n",
+             error->message);
+    g_error_free (error);
+    error = NULL;
+out:
+    g_free (samples);
+    g_object_unref (client);
+}
+
+typedef struct
+{
+    gchar  *url;
+    gint    stop;
+    int     count;
+    gint64  total_us;
+} BulkLoad;
+
+/*
+ * 在单独的线程中不停地请求图片，制造与音频竞争的大流量
+ */
+static gpointer BulkLoadThread (gpointer data)
+{
+    BulkLoad    *load    = (BulkLoad *)data;
+    SoupSession *session = soup_session_new ();
+    while (!g_atomic_int_get (&load->stop))
+    {
+        SoupMessage *msg   = NewBulkMessage (load->url);
+        gint64       start = g_get_monotonic_time ();
+        soup_session_send_message (session,
+                                   msg);
+        load->total_us += g_get_monotonic_time () - start;
+        load->count++;
+        g_object_unref (msg);
+    }
+    g_object_unref (session);
+    return NULL;
+}
+
+/*
+ * 在图片下载的背景流量下，分别测量不设置和设置套接字参数时
+ * 音频大小的WebSocket消息的往返时间(/echo)和图片请求的耗时(/image)
+ */
+void DoBenchSock (int count)
+{
+    const char  *names[]   = { "default", "tuned" };
+    gboolean     tuning    = sock_tuning;
+    SoupSession *session   = NewSession ();
+    double      *samples   = g_new (double, count);
+    for (int tuned = 0; tuned < 2; tuned++)
+    {
+        BulkLoad load[BENCH_BULK];
+        GThread *threads[BENCH_BULK];
+        sock_tuning = tuned;
+        for (int i = 0; i < BENCH_BULK; i++)
+        {
+            memset (&load[i], 0, sizeof (BulkLoad));
+            load[i].url = g_strconcat (BENCH_SERVER,
+                                       tuned ? "/image" : "/image?sock=raw",
+                                       NULL);
+            threads[i] = g_thread_new ("bulk",
+                                       BulkLoadThread,
+                                       &load[i]);
+        }
+        gchar *url  = g_strconcat (BENCH_SERVER,
+                                   tuned ? "/echo" : "/echo/raw",
+                                   NULL);
+        int    done = EchoRtt (session,
+                               url,
+                               count,
+                               samples);
+        g_free (url);
+
+        int    images   = 0;
+        gint64 image_us = 0;
+        for (int i = 0; i < BENCH_BULK; i++)
+        {
+            g_atomic_int_set (&load[i].stop,
+                              TRUE);
+            g_thread_join (threads[i]);
+            images += load[i].count;
+            image_us += load[i].total_us;
+            g_free (load[i].url);
+        }
+        if (done)
+        {
+            gchar *name = g_strconcat ("echo ",
+                                       names[tuned],
+                                       NULL);
+            ReportLatency (name,
+                           samples,
+                           done,
+                           0,
+                           1);
+            g_free (name);
+        }
+        if (images)
+            printf ("%-12s mean %8.1f us  (%d requests)\n",
+                    tuned ? "image tuned" : "image default",
+                    (double)image_us / images,
+                    images);
+    }
+    sock_tuning = tuning;
+    g_free (samples);
+    g_object_unref (session);
+}
+
+/*
+ * 基准测试的次数参数，省略时使用default_count，不是正整数时打印用法并返回FALSE
+ */
+static gboolean ParseCount (int    argc,
+                            char  *argv[],
+                            int    default_count,
+                            int   *count)
+{
+    gint64 value = default_count;
+    if (argc == 3
+    && !g_ascii_string_to_signed (argv[2],
+                                  10,
+                                  1,
+                                  G_MAXINT,
+                                  &value,
+                                  NULL))
+    {
+        printf ("Usage: %s %s [count]\n",
+                argv[0],
+                argv[1]);
+        return FALSE;
+    }
+    *count = (int)value;
+    return TRUE;
+}
+
 int main(int argc, char *argv[])
 {
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new ("[ get | image | post | mjpeg | ws | bench-uds | bench-tls | bench-sock ]");
+    g_option_context_add_main_entries (context,
+                                       entries,
+                                       NULL);
+    if (!g_option_context_parse (context,
+                                &argc,
+                                &argv,
+                                &error))
+    {
+        fprintf (stderr,
+                 "%s\n",
+                 error->message);
+        g_error_free (error);
+        return -1;
+    }
+    g_option_context_free (context);
+    if (log_name
+    && !LogSetLevel (log_name))
+    {
+        fprintf (stderr,
+                 "Unknown log level: %s\n",
+                 log_name);
+        return -1;
+    }
+    if (!server_uri)
+        server_uri = g_strdup (DEFAULT_SERVER);
     if (argc == 1)
     {
-        printf ("Usage: %s [ get | image | post | mjpeg | ws]\n",
+        printf ("Usage: %s [选项] [ get | image | post | mjpeg | ws | bench-uds | bench-tls | bench-sock ]\n",
                 argv[0]); 
         return -1;
     } 
@@ -375,7 +1124,14 @@ int main(int argc, char *argv[])
     else if (strcmp (argv[1], "ws") == 0)
     {
         if (argc == 4)
+        {
+/*
+ * 声卡回调中的日志交给后台线程输出
+ */
+            LogInit ();
             DoWs(argv[2], argv[3]);
+            LogShutdown ();
+        }
         else
         {
             printf ("Usage: %s %s <playback device> <capture device>\n",
@@ -398,6 +1154,36 @@ int main(int argc, char *argv[])
             SDL_Quit();
         }
     }
+    else if (strcmp (argv[1], "bench-uds") == 0)
+    {
+        int count;
+        if (!ParseCount (argc,
+                         argv,
+                         1000,
+                        &count))
+            return -1;
+        DoBenchUds (count);
+    }
+    else if (strcmp (argv[1], "bench-tls") == 0)
+    {
+        int count;
+        if (!ParseCount (argc,
+                         argv,
+                         200,
+                        &count))
+            return -1;
+        DoBenchTls (count);
+    }
+    else if (strcmp (argv[1], "bench-sock") == 0)
+    {
+        int count;
+        if (!ParseCount (argc,
+                         argv,
+                         2000,
+                        &count))
+            return -1;
+        DoBenchSock (count);
+    }
     else
     {
         fprintf (stderr,
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "io_pool.h"
+#include "trace.h"
+
+typedef struct
+{
+    IoPoolFunc      func;
+    gpointer        job_data;
+    GDestroyNotify  job_free;
+    IoPoolCallback  callback;
+    gpointer        user_data;
+    gint64          queued_at;
+    GBytes         *result;
+    GError         *error;
+} IoTask;
+
+typedef struct
+{
+    gchar  *filename;
+    GBytes *data;
+} IoWriteJob;
+
+static GThreadPool  *pool       = NULL;
+static GMainContext *context    = NULL;
+static guint         queue_max  = 0;
+static GMutex        stats_lock;
+static IoPoolStats   stats;
+
+/*
+ * 在主循环中执行，把结果交给调用者
+ */
+static gboolean IoTaskComplete (gpointer data)
+{
+    IoTask   *task = (IoTask *)data;
+    TraceSpan span = TraceBegin ("io_pool.complete");
+    task->callback (task->result,
+                    task->error,
+                    task->user_data);
+    TraceEnd (&span);
+    if (task->result)
+        g_bytes_unref (task->result);
+    if (task->error)
+        g_error_free (task->error);
+    if (task->job_free)
+        task->job_free (task->job_data);
+    g_free (task);
+
+    g_mutex_lock (&stats_lock);
+    stats.completed++;
+    g_mutex_unlock (&stats_lock);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * 在工作线程中执行
+ */
+static void IoTaskRun (gpointer data,
+                       gpointer pool_data)
+{
+    IoTask *task = (IoTask *)data;
+    gint64  wait = g_get_monotonic_time () - task->queued_at;
+
+    g_mutex_lock (&stats_lock);
+    stats.queue_depth--;
+    stats.total_wait_us += wait;
+    if (wait > stats.max_wait_us)
+        stats.max_wait_us = wait;
+    g_mutex_unlock (&stats_lock);
+
+    TraceSpan span = TraceBegin ("io_pool.job");
+    task->result = task->func (task->job_data,
+                              &task->error);
+    TraceEnd (&span);
+    g_main_context_invoke (context,
+                           IoTaskComplete,
+                           task);
+}
+
+static GBytes *IoReadFunc (gpointer  job_data,
+                           GError  **error)
+{
+    const char *filename = (const char *)job_data;
+    gchar      *body     = NULL;
+    gsize       length;
+    if (!g_file_get_contents (filename,
+                              &body,
+                              &length,
+                              error))
+        return NULL;
+    return g_bytes_new_take (body,
+                             length);
+}
+
+static GBytes *IoWriteFunc (gpointer  job_data,
+                            GError  **error)
+{
+    IoWriteJob *job = (IoWriteJob *)job_data;
+    gsize       length;
+    const char *body = g_bytes_get_data (job->data,
+                                        &length);
+    g_file_set_contents (job->filename,
+                         body,
+                         length,
+                         error);
+    return NULL;
+}
+
+static void IoWriteJobFree (gpointer data)
+{
+    IoWriteJob *job = (IoWriteJob *)data;
+    g_free (job->filename);
+    g_bytes_unref (job->data);
+    g_free (job);
+}
+
+/*
+ * max_threads：工作线程数上限
+ * max_queue  ：排队任务数上限，超过时提交失败，由调用者决定如何应答
+ * 完成回调在调用本函数的线程所属的GMainContext中执行
+ */
+gboolean IoPoolInit (guint max_threads,
+                     guint max_queue)
+{
+    GError *error = NULL;
+    pool = g_thread_pool_new (IoTaskRun,
+                              NULL,
+                              max_threads,
+                              FALSE,
+                             &error);
+    if (error)
+    {
+        fprintf (stderr,
+                 "Can't create io pool: %s\n",
+                 error->message);
+        g_error_free (error);
+        error = NULL;
+        return FALSE;
+    }
+    context = g_main_context_ref_thread_default ();
+    queue_max = max_queue;
+    memset (&stats, 0, sizeof (stats));
+    stats.threads = max_threads;
+    return TRUE;
+}
+
+/*
+ * 等待所有已提交的任务完成
+ */
+void IoPoolShutdown (void)
+{
+    if (!pool)
+        return;
+    g_thread_pool_free (pool,
+                        FALSE,
+                        TRUE);
+    pool = NULL;
+    g_main_context_unref (context);
+    context = NULL;
+}
+
+gboolean IoPoolSubmit (IoPoolFunc      func,
+                       gpointer        job_data,
+                       GDestroyNotify  job_free,
+                       IoPoolCallback  callback,
+                       gpointer        user_data)
+{
+    g_mutex_lock (&stats_lock);
+    if (!pool
+    || stats.queue_depth >= queue_max)
+    {
+        stats.rejected++;
+        g_mutex_unlock (&stats_lock);
+        if (job_free)
+            job_free (job_data);
+        return FALSE;
+    }
+    stats.submitted++;
+    stats.queue_depth++;
+    if (stats.queue_depth > stats.max_queue_depth)
+        stats.max_queue_depth = stats.queue_depth;
+    g_mutex_unlock (&stats_lock);
+
+    IoTask *task    = g_new0 (IoTask, 1);
+    task->func      = func;
+    task->job_data  = job_data;
+    task->job_free  = job_free;
+    task->callback  = callback;
+    task->user_data = user_data;
+    task->queued_at = g_get_monotonic_time ();
+    g_thread_pool_push (pool,
+                        task,
+                        NULL);
+    return TRUE;
+}
+
+gboolean IoPoolRead (const char     *filename,
+                     IoPoolCallback  callback,
+                     gpointer        user_data)
+{
+    return IoPoolSubmit (IoReadFunc,
+                         g_strdup (filename),
+                         g_free,
+                         callback,
+                         user_data);
+}
+
+gboolean IoPoolWrite (const char     *filename,
+                      GBytes         *data,
+                      IoPoolCallback  callback,
+                      gpointer        user_data)
+{
+    IoWriteJob *job = g_new0 (IoWriteJob, 1);
+    job->filename   = g_strdup (filename);
+    job->data       = g_bytes_ref (data);
+    return IoPoolSubmit (IoWriteFunc,
+                         job,
+                         IoWriteJobFree,
+                         callback,
+                         user_data);
+}
+
+void IoPoolGetStats (IoPoolStats *out)
+{
+    g_mutex_lock (&stats_lock);
+    *out = stats;
+    g_mutex_unlock (&stats_lock);
+}
@@ -0,0 +1,53 @@
+#ifndef _IO_POOL_H
+#define _IO_POOL_H
+
+#include <glib.h>
+
+/*
+ * 文件读写线程池
+ * 阻塞的文件操作在工作线程中完成，完成后的回调在主循环中执行。
+ */
+
+/*
+ * 在工作线程中执行的任务，返回的数据交给完成回调
+ */
+typedef GBytes *(*IoPoolFunc) (gpointer  job_data,
+                               GError  **error);
+
+/*
+ * 在主循环中执行的完成回调，data和error都由线程池负责释放
+ */
+typedef void (*IoPoolCallback) (GBytes  *data,
+                                GError  *error,
+                                gpointer user_data);
+
+typedef struct
+{
+    guint  threads;
+    guint  submitted;
+    guint  completed;
+    guint  rejected;
+    guint  queue_depth;
+    guint  max_queue_depth;
+    gint64 total_wait_us;
+    gint64 max_wait_us;
+} IoPoolStats;
+
+gboolean IoPoolInit (guint max_threads,
+                     guint max_queue);
+void IoPoolShutdown (void);
+gboolean IoPoolSubmit (IoPoolFunc      func,
+                       gpointer        job_data,
+                       GDestroyNotify  job_free,
+                       IoPoolCallback  callback,
+                       gpointer        user_data);
+gboolean IoPoolRead (const char     *filename,
+                     IoPoolCallback  callback,
+                     gpointer        user_data);
+gboolean IoPoolWrite (const char     *filename,
+                      GBytes         *data,
+                      IoPoolCallback  callback,
+                      gpointer        user_data);
+void IoPoolGetStats (IoPoolStats *stats);
+
+#endif
@@ -0,0 +1,380 @@
+#include <string.h>
+#include <libsoup/soup.h>
+#include "trace.h"
+#include "log_util.h"
+#include "limit.h"
+
+#define LIMIT_TOO_MANY_REQUESTS 429
+#define LIMIT_SAMPLE_MS         100
+#define LIMIT_IDLE_S            10
+#define LIMIT_LOCAL_HOST        "local"
+
+/*
+ * 按流计数的端点
+ */
+static const char *stream_paths[] = { "/mjpeg", "/listen" };
+#define LIMIT_STREAMS G_N_ELEMENTS (stream_paths)
+
+LimitConfig limit_config =
+{
+    .rate           = 50,
+    .global_rate    = 500,
+    .upload         = 8 * 1024,
+    .global_upload  = 32 * 1024,
+    .streams        = 8,
+    .global_streams = 512,
+    .buffered       = 64,
+};
+
+/*
+ * 令牌桶，容量为1秒的速率
+ */
+typedef struct
+{
+    double tokens;
+    gint64 updated;
+} LimitBucket;
+
+typedef struct
+{
+    LimitBucket requests;
+    LimitBucket bytes;
+    guint       active;
+    guint       streams[LIMIT_STREAMS];
+    gint64      seen;
+} LimitClient;
+
+/*
+ * 每个已放行的请求一个，stream为-1时不是流
+ */
+typedef struct
+{
+    LimitClient *client;
+    int          stream;
+    guint64      written;
+} LimitRequest;
+
+static GHashTable  *clients  = NULL;
+static GHashTable  *requests = NULL;
+static LimitBucket  global_requests;
+static LimitBucket  global_bytes;
+static guint        global_streams[LIMIT_STREAMS];
+static guint64      buffered = 0;
+static gint64       sampled  = 0;
+static gint64       swept    = 0;
+static LimitStats   stats;
+
+/*
+ * cost超过容量时只要桶满即可放行，令牌可以透支为负
+ */
+static gboolean LimitTake (LimitBucket *bucket,
+                           double       rate,
+                           double       cost,
+                           gint64       now)
+{
+    if (rate <= 0)
+        return TRUE;
+    bucket->tokens = MIN (rate,
+                          bucket->tokens + (now - bucket->updated) * rate / G_USEC_PER_SEC);
+    bucket->updated = now;
+    if (bucket->tokens < MIN (cost, rate))
+        return FALSE;
+    bucket->tokens -= cost;
+    return TRUE;
+}
+
+/*
+ * 统计未写出的应答字节数，顺便清理长时间没有请求的客户端
+ */
+static void LimitSample (gint64 now)
+{
+    if (now - sampled < LIMIT_SAMPLE_MS * 1000)
+        return;
+    sampled = now;
+    buffered = 0;
+    GHashTableIter iter;
+    gpointer       key;
+    gpointer       value;
+    g_hash_table_iter_init (&iter,
+                            requests);
+    while (g_hash_table_iter_next (&iter,
+                                  &key,
+                                  &value))
+    {
+        SoupMessage  *msg     = (SoupMessage *)key;
+        LimitRequest *request = (LimitRequest *)value;
+        if ((guint64)msg->response_body->length > request->written)
+            buffered += msg->response_body->length - request->written;
+    }
+
+    if (now - swept < LIMIT_IDLE_S * G_USEC_PER_SEC)
+        return;
+    swept = now;
+    g_hash_table_iter_init (&iter,
+                            clients);
+    while (g_hash_table_iter_next (&iter,
+                                   NULL,
+                                  &value))
+    {
+        LimitClient *client = (LimitClient *)value;
+        if (!client->active
+        && now - client->seen > LIMIT_IDLE_S * G_USEC_PER_SEC)
+            g_hash_table_iter_remove (&iter);
+    }
+}
+
+static void LimitWroteBodyData (SoupMessage *msg,
+                                SoupBuffer  *chunk,
+                                gpointer     user_data)
+{
+    LimitRequest *request = (LimitRequest *)user_data;
+    request->written += chunk->length;
+}
+
+static void LimitFinished (SoupMessage *msg,
+                           gpointer     user_data)
+{
+    LimitRequest *request = (LimitRequest *)user_data;
+    g_signal_handlers_disconnect_by_data (msg,
+                                          request);
+    request->client->active--;
+    if (request->stream >= 0)
+    {
+        request->client->streams[request->stream]--;
+        global_streams[request->stream]--;
+    }
+    g_hash_table_remove (requests,
+                         msg);
+}
+
+static void LimitReject (SoupMessage *msg,
+                         gboolean     global,
+                         guint64     *counter)
+{
+    (*counter)++;
+    if (global)
+    {
+        stats.rejected_global++;
+        soup_message_set_status (msg,
+                                 SOUP_STATUS_SERVICE_UNAVAILABLE);
+    }
+    else
+    {
+        stats.rejected_client++;
+        soup_message_set_status_full (msg,
+                                      LIMIT_TOO_MANY_REQUESTS,
+                                      "Too Many Requests");
+    }
+    soup_message_headers_replace (msg->response_headers,
+                                  "Retry-After",
+                                  "1");
+/*
+ * 请求体不会被读取，不能继续使用这个连接
+ */
+    if (soup_message_headers_get_content_length (msg->request_headers))
+        soup_message_headers_replace (msg->response_headers,
+                                      "Connection",
+                                      "close");
+}
+
+static int LimitStream (const char *path)
+{
+    for (guint i = 0; i < LIMIT_STREAMS; i++)
+        if (g_strcmp0 (path,
+                       stream_paths[i]) == 0)
+            return i;
+    return -1;
+}
+
+static void LimitEarlyHandler (SoupServer        *server,
+                               SoupMessage       *msg,
+                               const char        *path,
+                               GHashTable        *query,
+                               SoupClientContext *context,
+                               gpointer           user_data)
+{
+    TraceSpan    span   = TraceBegin ("limit.check");
+    gint64       now    = g_get_monotonic_time ();
+    const char  *host   = soup_client_context_get_host (context);
+    LimitClient *client;
+    if (!host
+    || !*host)
+        host = LIMIT_LOCAL_HOST;
+    LimitSample (now);
+    client = g_hash_table_lookup (clients,
+                                  host);
+    if (!client)
+    {
+        client = g_new0 (LimitClient, 1);
+        g_hash_table_insert (clients,
+                             g_strdup (host),
+                             client);
+    }
+    client->seen = now;
+
+    double length = soup_message_headers_get_content_length (msg->request_headers);
+    int    stream = LimitStream (path);
+    if (!LimitTake (&client->requests,
+                    limit_config.rate,
+                    1,
+                    now))
+        LimitReject (msg,
+                     FALSE,
+                    &stats.rejected_rate);
+    else if (!LimitTake (&global_requests,
+                         limit_config.global_rate,
+                         1,
+                         now))
+        LimitReject (msg,
+                     TRUE,
+                    &stats.rejected_rate);
+    else if (length > 0
+         && !LimitTake (&client->bytes,
+                        limit_config.upload * 1024.0,
+                        length,
+                        now))
+        LimitReject (msg,
+                     FALSE,
+                    &stats.rejected_upload);
+    else if (length > 0
+         && !LimitTake (&global_bytes,
+                        limit_config.global_upload * 1024.0,
+                        length,
+                        now))
+        LimitReject (msg,
+                     TRUE,
+                    &stats.rejected_upload);
+    else if (stream >= 0
+         && limit_config.streams > 0
+         && client->streams[stream] >= (guint)limit_config.streams)
+        LimitReject (msg,
+                     FALSE,
+                    &stats.rejected_streams);
+    else if (stream >= 0
+         && limit_config.global_streams > 0
+         && global_streams[stream] >= (guint)limit_config.global_streams)
+        LimitReject (msg,
+                     TRUE,
+                    &stats.rejected_streams);
+    else if (limit_config.buffered > 0
+         && buffered >= (guint64)limit_config.buffered * 1024 * 1024)
+        LimitReject (msg,
+                     TRUE,
+                    &stats.rejected_buffered);
+/*
+ * WebSocket升级后连接被取走，不一定有finished信号，只做速率限制
+ */
+    else if (!soup_message_headers_header_contains (msg->request_headers,
+                                                    "Upgrade",
+                                                    "websocket"))
+    {
+        LimitRequest *request = g_new0 (LimitRequest, 1);
+        request->client = client;
+        request->stream = stream;
+        client->active++;
+        if (stream >= 0)
+        {
+            client->streams[stream]++;
+            global_streams[stream]++;
+        }
+        g_hash_table_insert (requests,
+                             msg,
+                             request);
+        g_signal_connect (msg,
+                          "wrote-body-data",
+                          G_CALLBACK (LimitWroteBodyData),
+                          request);
+        g_signal_connect (msg,
+                          "finished",
+                          G_CALLBACK (LimitFinished),
+                          request);
+        stats.admitted++;
+    }
+    else
+        stats.admitted++;
+    TraceEnd (&span);
+}
+
+void LimitInit (SoupServer *server)
+{
+    clients = g_hash_table_new_full (g_str_hash,
+                                     g_str_equal,
+                                     g_free,
+                                     g_free);
+    requests = g_hash_table_new_full (g_direct_hash,
+                                      g_direct_equal,
+                                      NULL,
+                                      g_free);
+    memset (&global_requests, 0, sizeof (global_requests));
+    memset (&global_bytes, 0, sizeof (global_bytes));
+    memset (global_streams, 0, sizeof (global_streams));
+    memset (&stats, 0, sizeof (stats));
+    soup_server_add_early_handler (server,
+                                   "/",
+                                   LimitEarlyHandler,
+                                   NULL,
+                                   NULL);
+}
+
+/*
+ * early handler与处理函数一样按最具体的路径匹配，
+ * 注册在"/"上的只对没有单独注册的路径生效，所以每个处理函数的路径都要注册一次
+ */
+void LimitAddHandler (SoupServer         *server,
+                      const char         *path,
+                      SoupServerCallback  callback,
+                      gpointer            user_data,
+                      GDestroyNotify      destroy)
+{
+    soup_server_add_early_handler (server,
+                                   path,
+                                   LimitEarlyHandler,
+                                   NULL,
+                                   NULL);
+    soup_server_add_handler (server,
+                             path,
+                             callback,
+                             user_data,
+                             destroy);
+}
+
+void LimitAddWebsocketHandler (SoupServer                  *server,
+                               const char                  *path,
+                               const char                  *origin,
+                               char                       **protocols,
+                               SoupServerWebsocketCallback  callback,
+                               gpointer                     user_data,
+                               GDestroyNotify               destroy)
+{
+    soup_server_add_early_handler (server,
+                                   path,
+                                   LimitEarlyHandler,
+                                   NULL,
+                                   NULL);
+    soup_server_add_websocket_handler (server,
+                                       path,
+                                       origin,
+                                       protocols,
+                                       callback,
+                                       user_data,
+                                       destroy);
+}
+
+void LimitShutdown (void)
+{
+    g_clear_pointer (&requests,
+                     g_hash_table_unref);
+    g_clear_pointer (&clients,
+                     g_hash_table_unref);
+}
+
+void LimitGetStats (LimitStats *stats_out)
+{
+    *stats_out = stats;
+    stats_out->clients = clients ? g_hash_table_size (clients) : 0;
+    stats_out->requests = requests ? g_hash_table_size (requests) : 0;
+    stats_out->streams = 0;
+    for (guint i = 0; i < LIMIT_STREAMS; i++)
+        stats_out->streams += global_streams[i];
+    stats_out->buffered = buffered;
+}
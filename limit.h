@@ -0,0 +1,72 @@
+#ifndef _LIMIT_H
+#define _LIMIT_H
+
+#include <libsoup/soup.h>
+
+/*
+ * 准入控制
+ * 在读完请求头时(early handler)检查，请求体尚未读取，拒绝的代价很小：
+ *   请求速率    ：每个IP和全局各一个令牌桶，每个请求一个令牌
+ *   上传速率    ：按Content-Length扣除字节令牌(分块上传不计)，桶中有足够令牌即可放行，允许透支
+ *   流的并发数  ：/mjpeg、/listen各自按IP和全局计数
+ *   缓冲的应答  ：所有未写出的应答字节数(每LIMIT_SAMPLE_MS统计一次)
+ * 超过单个IP的限制返回429，超过全局限制返回503。
+ * 值为0的项不限制。Unix域套接字上的客户端都算作"local"。
+ * 所有函数都只能在主循环中调用。
+ */
+
+typedef struct
+{
+    int rate;           /* 每个IP每秒请求数 */
+    int global_rate;    /* 全局每秒请求数 */
+    int upload;         /* 每个IP每秒上传KB */
+    int global_upload;  /* 全局每秒上传KB */
+    int streams;        /* 每个IP每个流端点的并发数 */
+    int global_streams; /* 每个流端点的全局并发数 */
+    int buffered;       /* 未写出的应答总量，MB */
+} LimitConfig;
+
+typedef struct
+{
+    guint   clients;
+    guint   requests;
+    guint   streams;
+    guint64 buffered;
+    guint64 admitted;
+    guint64 rejected_rate;
+    guint64 rejected_upload;
+    guint64 rejected_streams;
+    guint64 rejected_buffered;
+    guint64 rejected_client;
+    guint64 rejected_global;
+} LimitStats;
+
+extern LimitConfig limit_config;
+
+/*
+ * 在"/"上注册准入检查，覆盖没有处理函数的路径
+ */
+void LimitInit (SoupServer *server);
+/*
+ * 与soup_server_add_handler、soup_server_add_websocket_handler相同，
+ * 同时在该路径上注册准入检查；soup_server_remove_handler会一并移除
+ */
+void LimitAddHandler (SoupServer         *server,
+                      const char         *path,
+                      SoupServerCallback  callback,
+                      gpointer            user_data,
+                      GDestroyNotify      destroy);
+void LimitAddWebsocketHandler (SoupServer                  *server,
+                               const char                  *path,
+                               const char                  *origin,
+                               char                       **protocols,
+                               SoupServerWebsocketCallback  callback,
+                               gpointer                     user_data,
+                               GDestroyNotify               destroy);
+/*
+ * 在SoupServer释放之后调用
+ */
+void LimitShutdown (void);
+void LimitGetStats (LimitStats *stats);
+
+#endif
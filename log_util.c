@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include "log_util.h"
+
+#define LOG_LINE        256
+#define LOG_RING_SIZE   256
+#define LOG_FLUSH_MS    50
+
+typedef struct
+{
+    gint64   time;
+    LogLevel level;
+    char     text[LOG_LINE];
+} LogRecord;
+
+/*
+ * 单生产者(所属线程)单消费者(写线程)的环形缓冲区
+ * head只由生产者修改，tail只由写线程修改
+ */
+typedef struct _LogRing LogRing;
+struct _LogRing
+{
+    guint     head;
+    guint     tail;
+    guint     dropped;
+    gint      orphaned;
+    gboolean  drained;
+    LogRing  *next;
+    LogRecord records[LOG_RING_SIZE];
+};
+
+LogLevel log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = { "error", "warning", "info", "debug" };
+static const char  level_tags[]  = { 'E', 'W', 'I', 'D' };
+
+static GMutex    rings_lock;
+static LogRing  *rings   = NULL;
+static GThread  *writer  = NULL;
+static GMutex    writer_lock;
+static GCond     writer_cond;
+static gboolean  writer_stop = FALSE;
+
+/*
+ * 线程退出时只做标记，由写线程取完剩余的行后释放
+ */
+static void LogRingOrphan (gpointer data)
+{
+    LogRing *ring = (LogRing *)data;
+    g_atomic_int_set (&ring->orphaned,
+                      TRUE);
+}
+
+static GPrivate ring_key = G_PRIVATE_INIT (LogRingOrphan);
+
+/*
+ * 每个线程第一次写日志时分配一次
+ */
+static LogRing *LogRingGet (void)
+{
+    LogRing *ring = g_private_get (&ring_key);
+    if (ring)
+        return ring;
+    ring = g_new0 (LogRing, 1);
+    g_mutex_lock (&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    g_mutex_unlock (&rings_lock);
+    g_private_set (&ring_key,
+                   ring);
+    return ring;
+}
+
+static void LogOutput (gint64      time,
+                       LogLevel    level,
+                       const char *text)
+{
+    time_t    seconds = time / G_USEC_PER_SEC;
+    struct tm local;
+    localtime_r (&seconds,
+                 &local);
+    fprintf (level <= LOG_LEVEL_WARNING ? stderr : stdout,
+             "%02d:%02d:%02d.%03d %c %s\n",
+             local.tm_hour,
+             local.tm_min,
+             local.tm_sec,
+             (int)(time % G_USEC_PER_SEC / 1000),
+             level_tags[level],
+             text);
+}
+
+/*
+ * 依次取空各线程的缓冲区，同一线程的行保持顺序
+ * 新的缓冲区只会插在链表头，链表节点只由这里删除，所以输出时不必持有rings_lock，
+ * 第一次写日志的线程不会因为终端或管道变慢而阻塞在LogRingGet中
+ */
+static void LogDrain (void)
+{
+    g_mutex_lock (&rings_lock);
+    LogRing *list = rings;
+    g_mutex_unlock (&rings_lock);
+    gboolean reap = FALSE;
+    for (LogRing *ring = list; ring; ring = ring->next)
+    {
+        gboolean orphaned = g_atomic_int_get (&ring->orphaned);
+        guint    head     = g_atomic_int_get (&ring->head);
+        for (; ring->tail != head; ring->tail++)
+        {
+            LogRecord *record = &ring->records[ring->tail % LOG_RING_SIZE];
+            LogOutput (record->time,
+                       record->level,
+                       record->text);
+        }
+        g_atomic_int_set (&ring->tail,
+                          head);
+        guint dropped = g_atomic_int_and (&ring->dropped,
+                                          0);
+        if (dropped)
+        {
+            char text[64];
+            snprintf (text,
+                      sizeof (text),
+                      "日志缓冲区已满，丢弃了%u行。",
+                      dropped);
+            LogOutput (g_get_real_time (),
+                       LOG_LEVEL_WARNING,
+                       text);
+        }
+        if (orphaned)
+        {
+            ring->drained = TRUE;
+            reap = TRUE;
+        }
+    }
+    fflush (stdout);
+    fflush (stderr);
+    if (!reap)
+        return;
+
+/*
+ * 释放线程已退出且已取空的缓冲区
+ */
+    g_mutex_lock (&rings_lock);
+    LogRing **link = &rings;
+    while (*link)
+    {
+        LogRing *ring = *link;
+        if (ring->drained)
+        {
+            *link = ring->next;
+            g_free (ring);
+        }
+        else
+            link = &ring->next;
+    }
+    g_mutex_unlock (&rings_lock);
+}
+
+static gpointer LogWriter (gpointer user_data)
+{
+    g_mutex_lock (&writer_lock);
+    while (!writer_stop)
+    {
+        g_cond_wait_until (&writer_cond,
+                           &writer_lock,
+                           g_get_monotonic_time () + LOG_FLUSH_MS * 1000);
+        g_mutex_unlock (&writer_lock);
+        LogDrain ();
+        g_mutex_lock (&writer_lock);
+    }
+    g_mutex_unlock (&writer_lock);
+    return NULL;
+}
+
+void LogInit (void)
+{
+    writer_stop = FALSE;
+    writer = g_thread_new ("log",
+                           LogWriter,
+                           NULL);
+}
+
+/*
+ * 停止写线程并输出剩余的行
+ */
+void LogShutdown (void)
+{
+    if (!writer)
+        return;
+    g_mutex_lock (&writer_lock);
+    writer_stop = TRUE;
+    g_cond_signal (&writer_cond);
+    g_mutex_unlock (&writer_lock);
+    g_thread_join (writer);
+    writer = NULL;
+    LogDrain ();
+}
+
+gboolean LogSetLevel (const char *name)
+{
+    for (guint i = 0; i < G_N_ELEMENTS (level_names); i++)
+        if (g_ascii_strcasecmp (name,
+                                level_names[i]) == 0)
+        {
+            log_level = (LogLevel)i;
+            return TRUE;
+        }
+    return FALSE;
+}
+
+/*
+ * 按秒计数，多个线程同时使用同一调用点时计数是近似的
+ */
+static gboolean LogSiteAllow (LogSite *site,
+                              gint64   now,
+                              guint   *suppressed)
+{
+    gint64 second = now / G_USEC_PER_SEC;
+    *suppressed = 0;
+    if (site->second != second)
+    {
+        site->second = second;
+        g_atomic_int_set (&site->count,
+                          0);
+        *suppressed = g_atomic_int_and (&site->suppressed,
+                                        0);
+    }
+    if (g_atomic_int_add (&site->count,
+                          1) < LOG_RATE_LIMIT)
+        return TRUE;
+    g_atomic_int_inc (&site->suppressed);
+    return FALSE;
+}
+
+void LogWrite (LogLevel    level,
+               LogSite    *site,
+               const char *format,
+               ...)
+{
+    gint64 now = g_get_real_time ();
+    guint  suppressed;
+    if (!LogSiteAllow (site,
+                       now,
+                      &suppressed))
+        return;
+
+    char    text[LOG_LINE];
+    va_list args;
+    va_start (args, format);
+    int length = vsnprintf (text,
+                            sizeof (text),
+                            format,
+                            args);
+    va_end (args);
+    if (suppressed
+    && length >= 0
+    && length < LOG_LINE)
+        snprintf (text + length,
+                  sizeof (text) - length,
+                  "（此前忽略了%u行）",
+                  suppressed);
+
+/*
+ * 未启动写线程时(如命令行工具)直接输出
+ */
+    if (!writer)
+    {
+        LogOutput (now,
+                   level,
+                   text);
+        return;
+    }
+
+    LogRing *ring = LogRingGet ();
+    guint    head = ring->head;
+    if (head - g_atomic_int_get (&ring->tail) >= LOG_RING_SIZE)
+    {
+        g_atomic_int_inc (&ring->dropped);
+        return;
+    }
+    LogRecord *record = &ring->records[head % LOG_RING_SIZE];
+    record->time = now;
+    record->level = level;
+    memcpy (record->text,
+            text,
+            sizeof (text));
+    g_atomic_int_set (&ring->head,
+                      head + 1);
+}
@@ -0,0 +1,59 @@
+#ifndef _LOG_UTIL_H
+#define _LOG_UTIL_H
+
+#include <glib.h>
+
+/*
+ * 异步日志
+ * 调用线程只把格式化好的一行放进本线程的环形缓冲区(无锁、不做系统调用，只在线程第一次写日志时分配内存)，
+ * 由后台线程写到stdout/stderr，处理函数和声卡回调不会因终端或管道变慢而阻塞。
+ * 每个调用点每秒最多输出LOG_RATE_LIMIT行，多出的计数后在下一行中说明；
+ * 缓冲区满时丢弃，丢弃的行数由后台线程报告。
+ */
+
+typedef enum
+{
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} LogLevel;
+
+#define LOG_RATE_LIMIT 20
+
+/*
+ * 每个调用点一个，由LOG宏定义为静态变量
+ */
+typedef struct
+{
+    gint64 second;
+    gint   count;
+    guint  suppressed;
+} LogSite;
+
+extern LogLevel log_level;
+
+void LogInit (void);
+void LogShutdown (void);
+gboolean LogSetLevel (const char *name);
+void LogWrite (LogLevel    level,
+               LogSite    *site,
+               const char *format,
+               ...) G_GNUC_PRINTF (3, 4);
+
+#define LOG(level, ...)                             \
+    do                                              \
+    {                                               \
+        static LogSite _log_site;                   \
+        if ((level) <= log_level)                   \
+            LogWrite ((level),                      \
+                      &_log_site,                   \
+                      __VA_ARGS__);                 \
+    } while (0)
+
+#define LOG_ERROR(...)   LOG (LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARNING(...) LOG (LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_INFO(...)    LOG (LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)   LOG (LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <glib.h>
+#include "log_util.h"
+#include "rt_util.h"
+
+static GThread      *thread  = NULL;
+static GMainContext *context = NULL;
+static GMainLoop    *loop    = NULL;
+static RtPolicy      policy;
+
+/*
+ * 在线程自身中调用，只影响本线程
+ */
+static void RtApplyPolicy (void)
+{
+    int error;
+    if (policy.cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO (&set);
+        CPU_SET (policy.cpu, &set);
+        if ((error = pthread_setaffinity_np (pthread_self (),
+                                             sizeof (set),
+                                            &set)))
+            LOG_WARNING ("无法绑定到CPU %d：%s",
+                         policy.cpu,
+                         strerror (error));
+    }
+    if (policy.priority > 0)
+    {
+        struct sched_param param;
+        memset (&param, 0, sizeof (param));
+        param.sched_priority = policy.priority;
+        if ((error = pthread_setschedparam (pthread_self (),
+                                            SCHED_FIFO,
+                                           &param)))
+            LOG_WARNING ("无法设置SCHED_FIFO优先级%d：%s",
+                         policy.priority,
+                         strerror (error));
+    }
+/*
+ * Linux上nice值是按线程的，PRIO_PROCESS配合线程id只修改本线程
+ */
+    else if (policy.nice
+         && setpriority (PRIO_PROCESS,
+                         syscall (SYS_gettid),
+                         policy.nice))
+        LOG_WARNING ("无法设置nice值%d：%s",
+                     policy.nice,
+                     strerror (errno));
+}
+
+static gpointer RtThreadRun (gpointer user_data)
+{
+    g_main_context_push_thread_default (context);
+    RtApplyPolicy ();
+    g_main_loop_run (loop);
+/*
+ * 退出前处理完已经提交的任务(如连接关闭)
+ */
+    while (g_main_context_iteration (context,
+                                     FALSE));
+    g_main_context_pop_thread_default (context);
+    return NULL;
+}
+
+gboolean RtThreadStart (const char     *name,
+                        const RtPolicy *rt_policy)
+{
+    GError *error = NULL;
+    policy = *rt_policy;
+    context = g_main_context_new ();
+    loop = g_main_loop_new (context,
+                            FALSE);
+    thread = g_thread_try_new (name,
+                               RtThreadRun,
+                               NULL,
+                              &error);
+    if (error)
+    {
+        LOG_ERROR ("Can't create thread %s: %s",
+                   name,
+                   error->message);
+        g_error_free (error);
+        error = NULL;
+        g_clear_pointer (&loop,
+                         g_main_loop_unref);
+        g_clear_pointer (&context,
+                         g_main_context_unref);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean RtThreadQuit (gpointer user_data)
+{
+    g_main_loop_quit (loop);
+    return G_SOURCE_REMOVE;
+}
+
+void RtThreadStop (void)
+{
+    if (!thread)
+        return;
+    g_main_context_invoke (context,
+                           RtThreadQuit,
+                           NULL);
+    g_thread_join (thread);
+    thread = NULL;
+    g_clear_pointer (&loop,
+                     g_main_loop_unref);
+    g_clear_pointer (&context,
+                     g_main_context_unref);
+}
+
+GMainContext *RtThreadContext (void)
+{
+    return context;
+}
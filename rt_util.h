@@ -0,0 +1,28 @@
+#ifndef _RT_UTIL_H
+#define _RT_UTIL_H
+
+#include <glib.h>
+
+/*
+ * 音频线程
+ * 一个运行私有GMainContext的线程，WebSocket音频连接在升级后交给它，
+ * 信号处理和发送不再排在主循环的HTTP处理函数后面。
+ * 线程启动时按RtPolicy设置调度策略和CPU亲和性，权限不足时只给出警告。
+ */
+
+typedef struct
+{
+    int priority;   /* SCHED_FIFO优先级(1-99)，0为不使用实时调度 */
+    int nice;       /* 不使用实时调度时的nice值，0为不修改 */
+    int cpu;        /* 绑定的CPU，-1为不绑定 */
+} RtPolicy;
+
+gboolean RtThreadStart (const char     *name,
+                        const RtPolicy *policy);
+void RtThreadStop (void);
+/*
+ * 线程的GMainContext，未启动时返回NULL
+ */
+GMainContext *RtThreadContext (void);
+
+#endif
@@ -1,21 +1,53 @@
 #include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <opus.h>
 #include <SDL2/SDL.h>
 #include <libsoup/soup.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <gio/gunixsocketaddress.h>
 #include "ws_util.h"
+#include "io_pool.h"
+#include "sock_util.h"
+#include "udp_util.h"
+#include "trace.h"
+#include "thumb.h"
+#include "log_util.h"
+#include "broadcast.h"
+#include "rt_util.h"
+#include "limit.h"
 
 /*
  * 一个基于LibSoup的Web Server例子
  * 参考https://libsoup.org/libsoup-2.4/libsoup-server-howto.html
  * 提供如下的服务：
  *      /get   :
- *      /image : 返回一副图片
+ *      /image : 返回一副图片，?w=&h=&q=时返回缩略图
  *      /post  : 上传一副图片
  *      /mjpeg : 获取mjpeg视频
+ *      /listen: 以Ogg Opus收听采音设备的实时声音，可同时有任意多个收听者
  *      /ws    : 建立websocket双向通道，每秒钟将当前时间发送给客户
+ *      /stats : 返回服务器内部的统计信息
+ *      /echo  : 原样返回WebSocket消息
+ *      /trace : 以Chrome trace-event格式返回最近的跟踪事件(--trace)
+ * 所有请求先经过准入控制(limit.h)，超过单个IP的限制返回429，超过全局限制返回503
+ * 同时监听TCP 1080端口和Unix域套接字(--socket)，
+ * 指定--tls-cert时还在--https-port上提供HTTPS/WSS
  * 编译命令：cc -o server server.c `pkg-config --cflags --libs libsoup-2.4`
  */
 
+#define DEFAULT_SOCKET  "/tmp/soup_example.sock"
+#define DEFAULT_HTTPS_PORT 1443
+#define IO_POOL_THREADS 4
+#define IO_POOL_QUEUE   64
+#define TRACE_EVENTS    65536
+#define DEFAULT_STALL_MS 50
+#define THUMB_QUALITY   75
+#define THUMB_MAX_SIZE  4096
+#define DEFAULT_THUMB_CACHE_MB 16
+
 /*
  * get服务，该服务仅仅向客户端返回一个连接正常的HTTP头。
  * 这是请求应答的最低要求。
@@ -28,12 +60,140 @@ void GetHandler (SoupServer        *server,
                  SoupClientContext *client,
                  gpointer          user_data)
 {
+    TraceSpan span = TraceBegin ("http.get");
     soup_message_set_status(msg, SOUP_STATUS_OK);
-    printf ("a get request.\n");
+    LOG_DEBUG ("a get request.");
+    TraceEnd (&span);
+}
+
+/*
+ * 按端点设置客户端连接的套接字参数
+ * 查询参数sock=raw时保持系统默认，用于对比测试
+ */
+void ApplySockProfile (SoupClientContext *client,
+                       GHashTable        *query,
+                       const SockProfile *profile)
+{
+    GSocket *socket = soup_client_context_get_gsocket (client);
+    if (!socket
+    || (query
+     && g_strcmp0 (g_hash_table_lookup (query,
+                                        "sock"),
+                   "raw") == 0))
+        return;
+    SockProfileApply (g_socket_get_fd (socket),
+                      profile);
+}
+
+/*
+ * 被暂停的请求
+ * 文件操作交给io_pool完成，期间消息处于暂停状态；
+ * 若客户端在此期间断开，消息已结束，完成回调中不能再恢复它。
+ */
+typedef struct
+{
+    SoupServer  *server;
+    SoupMessage *msg;
+    gboolean     finished;
+} PausedRequest;
+
+void PausedRequestFinished (SoupMessage *msg,
+                            gpointer     user_data)
+{
+    PausedRequest *request = (PausedRequest *)user_data;
+    request->finished = TRUE;
+}
+
+PausedRequest *PausedRequestNew (SoupServer  *server,
+                                 SoupMessage *msg)
+{
+    PausedRequest *request = g_new0 (PausedRequest, 1);
+    request->server = server;
+    request->msg = g_object_ref (msg);
+    g_signal_connect (msg,
+                      "finished",
+                      G_CALLBACK (PausedRequestFinished),
+                      request);
+    soup_server_pause_message (server,
+                               msg);
+    return request;
+}
+
+void PausedRequestDone (PausedRequest *request)
+{
+    g_signal_handlers_disconnect_by_func (request->msg,
+                                          PausedRequestFinished,
+                                          request);
+    if (!request->finished)
+        soup_server_unpause_message (request->server,
+                                     request->msg);
+    g_object_unref (request->msg);
+    g_free (request);
+}
+
+void ImageRead (GBytes  *data,
+                GError  *error,
+                gpointer user_data)
+{
+    TraceSpan span = TraceBegin ("http.image.read");
+    PausedRequest *request = (PausedRequest *)user_data;
+    if (error)
+    {
+        LOG_WARNING ("Can't read from file: %s",
+                     error->message);
+        soup_message_set_status (request->msg,
+                                 SOUP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    else
+    {
+        gsize  length;
+        gchar *body = g_bytes_unref_to_data (g_bytes_ref (data),
+                                            &length);
+        soup_message_set_status (request->msg,
+                                 SOUP_STATUS_OK);
+        soup_message_set_response (request->msg,
+                                   "image/jpeg",
+                                   SOUP_MEMORY_TAKE,
+                                   body,
+                                   length);
+    }
+    PausedRequestDone (request);
+    LOG_DEBUG ("image request.");
+    TraceEnd (&span);
+}
+
+/*
+ * 取整数查询参数，不存在时为default_value，超出[min, max]时返回FALSE
+ */
+gboolean QueryInt (GHashTable *query,
+                   const char *name,
+                   int         min,
+                   int         max,
+                   int         default_value,
+                   int        *value)
+{
+    const char *text = query ? g_hash_table_lookup (query,
+                                                    name)
+                             : NULL;
+    *value = default_value;
+    if (!text)
+        return TRUE;
+    gint64 number;
+    if (!g_ascii_string_to_signed (text,
+                                   10,
+                                   min,
+                                   max,
+                                  &number,
+                                   NULL))
+        return FALSE;
+    *value = (int)number;
+    return TRUE;
 }
 
 /*
  * image服务，该服务向客户端返回一副图片。
+ * 文件在io_pool中读取，不阻塞主循环。
+ * 带w、h、q参数时返回按比例缩小(不放大)的缩略图，结果由thumb缓存
  */
 void ImageHandler (SoupServer        *server,
                    SoupMessage       *msg,
@@ -42,34 +202,65 @@ void ImageHandler (SoupServer        *server,
                    SoupClientContext *client,
                    gpointer          user_data)
 {
-    soup_message_set_status(msg, SOUP_STATUS_OK);
-    soup_message_headers_set_content_type(msg->response_headers,
-                                          "image/jpeg",
-                                           NULL);
-    const char *filename = "example.jpg";
-    gchar         *body  = NULL;
-    gsize          length;
-    GError        *error = NULL;
-    g_file_get_contents (filename,
-                         &body,
-                         &length,
-                         &error);
-    if (error)
+    TraceSpan span = TraceBegin ("http.image");
+    const char    *filename = "example.jpg";
+    ApplySockProfile (client,
+                      query,
+                      &sock_profile_bulk);
+    int width;
+    int height;
+    int quality;
+    if (!QueryInt (query, "w", 0, THUMB_MAX_SIZE, 0, &width)
+    || !QueryInt (query, "h", 0, THUMB_MAX_SIZE, 0, &height)
+    || !QueryInt (query, "q", 1, 100, THUMB_QUALITY, &quality))
     {
-        fprintf (stderr,
-                 "Can't read from file: %s\n",
-                 filename);
-        g_error_free (error);
-        error = NULL;
+        soup_message_set_status (msg,
+                                 SOUP_STATUS_BAD_REQUEST);
+        TraceEnd (&span);
+        return;
+    }
+    gboolean       thumb    = query
+                           && (g_hash_table_contains (query, "w")
+                            || g_hash_table_contains (query, "h")
+                            || g_hash_table_contains (query, "q"));
+    PausedRequest *request  = PausedRequestNew (server,
+                                                msg);
+    gboolean       queued   = thumb ? ThumbGet (filename,
+                                                width,
+                                                height,
+                                                quality,
+                                                ImageRead,
+                                                request)
+                                    : IoPoolRead (filename,
+                                                  ImageRead,
+                                                  request);
+    if (!queued)
+    {
+        soup_message_set_status (msg,
+                                 SOUP_STATUS_SERVICE_UNAVAILABLE);
+        PausedRequestDone (request);
     }
+    TraceEnd (&span);
+}
 
-    soup_message_set_response (msg,
-                               "image/jpeg",
-                               SOUP_MEMORY_TAKE,
-	                       body,
-                               length);
-    // clean up
-    printf ("image request.\n");
+void PostWritten (GBytes  *data,
+                  GError  *error,
+                  gpointer user_data)
+{
+    TraceSpan span = TraceBegin ("http.post.written");
+    PausedRequest *request = (PausedRequest *)user_data;
+    if (error)
+    {
+        LOG_WARNING ("Can't write to file: %s",
+                     error->message);
+        soup_message_set_status (request->msg,
+                                 SOUP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    else
+        soup_message_set_status (request->msg,
+                                 SOUP_STATUS_OK);
+    PausedRequestDone (request);
+    TraceEnd (&span);
 }
 
 void PostHandler (SoupServer        *server,
@@ -79,22 +270,22 @@ void PostHandler (SoupServer        *server,
                   SoupClientContext *client,
                   gpointer          user_data)
 {
-    SoupMessageHeadersIter iter;
-    soup_message_headers_iter_init (&iter,
-                                    msg->request_headers);
-
+    TraceSpan span = TraceBegin ("http.post");
     const char *name = NULL;
     const char *value = NULL;
-    while (soup_message_headers_iter_next (&iter,
-                                           &name,
-                                           &value))
+    if (log_level >= LOG_LEVEL_DEBUG)
     {
-        printf ("%s: %s\n",
-                name,
-                value);
+        SoupMessageHeadersIter iter;
+        soup_message_headers_iter_init (&iter,
+                                        msg->request_headers);
+        while (soup_message_headers_iter_next (&iter,
+                                               &name,
+                                               &value))
+            LOG_DEBUG ("%s: %s",
+                       name,
+                       value);
     }
 
-    soup_message_set_status(msg, SOUP_STATUS_OK);
     int pos_x = -1;
     int pos_y = -1;
 
@@ -102,30 +293,36 @@ void PostHandler (SoupServer        *server,
                                               "Pos-X")) != NULL)
     {
         pos_x = atoi(value);
-        printf ("pos-x: %d\n",
-                pos_x);
+        LOG_DEBUG ("pos-x: %d",
+                   pos_x);
     }
     if ((value = soup_message_headers_get_one(msg->request_headers,
                                               "Pos-Y")) != NULL)
     {
         pos_y = atoi(value);
-        printf ("pos-y: %d\n",
-                pos_y);
+        LOG_DEBUG ("pos-y: %d",
+                   pos_y);
     }
+/*
+ * 请求体在io_pool中写入文件，写完后再应答
+ */
     const char    *filename = "post.jpg";
-    GError        *error    = NULL;
-    g_file_set_contents (filename,
-                         msg->request_body->data,
-                         msg->request_body->length,
-                        &error);
-    if (error)
+    SoupBuffer    *buffer   = soup_message_body_flatten (msg->request_body);
+    GBytes        *body     = soup_buffer_get_as_bytes (buffer);
+    PausedRequest *request  = PausedRequestNew (server,
+                                                msg);
+    if (!IoPoolWrite (filename,
+                      body,
+                      PostWritten,
+                      request))
     {
-        fprintf (stderr,
-                 "Can't write to file: %s\n",
-                 filename);
-        g_error_free (error);
-        error = NULL;
+        soup_message_set_status (msg,
+                                 SOUP_STATUS_SERVICE_UNAVAILABLE);
+        PausedRequestDone (request);
     }
+    g_bytes_unref (body);
+    soup_buffer_free (buffer);
+    TraceEnd (&span);
 }
 
 typedef struct
@@ -133,28 +330,34 @@ typedef struct
     SoupServer  *server;
     SoupMessage *msg;
     guint        timeout_id;
+    gboolean     reading;
+    gboolean     finished;
 } SoupServerInfo;
 
-gboolean Jpeger (gpointer data)
+void JpegerRead (GBytes  *data,
+                 GError  *error,
+                 gpointer user_data)
 {
-    SoupServerInfo *info = (SoupServerInfo *)data;
-    const char *filename = "example.jpg";
-    gchar      *body     = NULL;
-    gsize       length;
-    GError     *error    = NULL;
-    g_file_get_contents (filename,
-                         &body,
-                         &length,
-                         &error);
+    SoupServerInfo *info = (SoupServerInfo *)user_data;
+    info->reading = FALSE;
+/*
+ * 读文件期间客户端已断开，由这里释放info
+ */
+    if (info->finished)
+    {
+        g_free (info);
+        return;
+    }
     if (error)
     {
-        fprintf (stderr,
-                 "Can't read from file: %s\n",
-                 filename);
-        g_error_free (error);
-        error = NULL;
+        LOG_WARNING ("Can't read from file: %s",
+                     error->message);
+        return;
     }
 
+    gsize  length;
+    gchar *body   = g_bytes_unref_to_data (g_bytes_ref (data),
+                                          &length);
     gchar *header = g_malloc (1024);
     struct timespec t;
     clock_gettime (CLOCK_REALTIME , &t);
@@ -173,7 +376,23 @@ gboolean Jpeger (gpointer data)
                               length);
     soup_server_unpause_message (info->server,
                                  info->msg);
-    printf ("send a jpeg file.\n");
+    LOG_DEBUG ("send a jpeg file.");
+}
+
+/*
+ * 定时器只提交读文件任务，上一帧还没读完时跳过本帧
+ */
+gboolean Jpeger (gpointer data)
+{
+    SoupServerInfo *info = (SoupServerInfo *)data;
+    const char *filename = "example.jpg";
+    if (info->reading)
+        return TRUE;
+    TraceSpan span = TraceBegin ("mjpeg.timer");
+    info->reading = IoPoolRead (filename,
+                                JpegerRead,
+                                info);
+    TraceEnd (&span);
     return TRUE;
 }
 
@@ -182,7 +401,10 @@ void MjpegHandlerFinished (SoupMessage *msg,
 {
     SoupServerInfo *info= (SoupServerInfo *)user_data;
     g_source_remove (info->timeout_id);
-    free (info);
+    if (info->reading)
+        info->finished = TRUE;
+    else
+        g_free (info);
 }
 
 void MjpegHandler (SoupServer        *server,
@@ -192,13 +414,17 @@ void MjpegHandler (SoupServer        *server,
                    SoupClientContext *client,
                    gpointer          user_data)
 {
+    TraceSpan span = TraceBegin ("http.mjpeg");
+    ApplySockProfile (client,
+                      query,
+                      &sock_profile_bulk);
     soup_message_set_status(msg, SOUP_STATUS_OK);
     soup_message_headers_set_encoding (msg->response_headers,
                                        SOUP_ENCODING_CHUNKED);
     soup_message_headers_set_content_type(msg->response_headers,
                                           "multipart/x-mixed-replace;boundary=boundarydonotcross",
                                            NULL);
-    SoupServerInfo *info = g_malloc (sizeof (SoupServerInfo));
+    SoupServerInfo *info = g_new0 (SoupServerInfo, 1);
     info->server = server;
     info->msg = msg;
     info->timeout_id = g_timeout_add (1000,
@@ -208,25 +434,555 @@ void MjpegHandler (SoupServer        *server,
                       "finished",
                       G_CALLBACK (MjpegHandlerFinished),
                       info);
+    TraceEnd (&span);
 }
 
-void WsHandler (SoupServer *server,
-                SoupWebsocketConnection *connection,
-                const char *path,
-                SoupClientContext *client,
-                gpointer user_data)
+/*
+ * listen服务，应答由broadcast模块持续写出
+ */
+void ListenHandler (SoupServer        *server,
+                    SoupMessage       *msg,
+                    char const        *path,
+                    GHashTable        *query,
+                    SoupClientContext *client,
+                    gpointer          user_data)
 {
+    TraceSpan span = TraceBegin ("http.listen");
     WsInfo *info = (WsInfo *)user_data;
+    ApplySockProfile (client,
+                      query,
+                      &sock_profile_bulk);
+    if (!BroadcastAttach (server,
+                          msg,
+                          info->capture_device))
+        soup_message_set_status (msg,
+                                 SOUP_STATUS_SERVICE_UNAVAILABLE);
+    TraceEnd (&span);
+}
+
+/*
+ * stats服务，以文本形式返回io_pool的队列深度与等待时间，以及主循环的调度延迟
+ */
+void StatsHandler (SoupServer        *server,
+                   SoupMessage       *msg,
+                   char const        *path,
+                   GHashTable        *query,
+                   SoupClientContext *client,
+                   gpointer          user_data)
+{
+    TraceSpan span = TraceBegin ("http.stats");
+    IoPoolStats io;
+    TraceStats  loop;
+    ThumbStats  thumb;
+    BroadcastStats broadcast;
+    LimitStats     limit;
+    IoPoolGetStats (&io);
+    TraceGetStats (&loop);
+    ThumbGetStats (&thumb);
+    BroadcastGetStats (&broadcast);
+    LimitGetStats (&limit);
+    GString *body = g_string_new (NULL);
+    g_string_append_printf (body,
+                            "io_pool.threads: %u\n"
+                            "io_pool.submitted: %u\n"
+                            "io_pool.completed: %u\n"
+                            "io_pool.rejected: %u\n"
+                            "io_pool.queue_depth: %u\n"
+                            "io_pool.max_queue_depth: %u\n"
+                            "io_pool.avg_wait_us: %" G_GINT64_FORMAT "\n"
+                            "io_pool.max_wait_us: %" G_GINT64_FORMAT "\n",
+                            io.threads,
+                            io.submitted,
+                            io.completed,
+                            io.rejected,
+                            io.queue_depth,
+                            io.max_queue_depth,
+                            io.submitted > io.queue_depth
+                            ? io.total_wait_us / (io.submitted - io.queue_depth)
+                            : 0,
+                            io.max_wait_us);
+    g_string_append_printf (body,
+                            "main_loop.stalls: %u\n"
+                            "main_loop.avg_latency_us: %" G_GINT64_FORMAT "\n"
+                            "main_loop.max_latency_us: %" G_GINT64_FORMAT "\n"
+                            "trace.events: %u\n",
+                            loop.stalls,
+                            loop.beats ? loop.total_latency_us / loop.beats : 0,
+                            loop.max_latency_us,
+                            loop.events);
+    g_string_append_printf (body,
+                            "thumb.hits: %u\n"
+                            "thumb.misses: %u\n"
+                            "thumb.collapsed: %u\n"
+                            "thumb.encodes: %u\n"
+                            "thumb.evictions: %u\n"
+                            "thumb.entries: %u\n"
+                            "thumb.bytes: %" G_GSIZE_FORMAT "\n"
+                            "thumb.max_bytes: %" G_GSIZE_FORMAT "\n",
+                            thumb.hits,
+                            thumb.misses,
+                            thumb.collapsed,
+                            thumb.encodes,
+                            thumb.evictions,
+                            thumb.entries,
+                            thumb.bytes,
+                            thumb.max_bytes);
+    g_string_append_printf (body,
+                            "broadcast.listeners: %u\n"
+                            "broadcast.max_listeners: %u\n"
+                            "broadcast.pages: %u\n"
+                            "broadcast.bytes: %" G_GUINT64_FORMAT "\n"
+                            "broadcast.sent: %" G_GUINT64_FORMAT "\n"
+                            "broadcast.skipped: %" G_GUINT64_FORMAT "\n",
+                            broadcast.listeners,
+                            broadcast.max_listeners,
+                            broadcast.pages,
+                            broadcast.bytes,
+                            broadcast.sent,
+                            broadcast.skipped);
+    g_string_append_printf (body,
+                            "limit.clients: %u\n"
+                            "limit.requests: %u\n"
+                            "limit.streams: %u\n"
+                            "limit.buffered_bytes: %" G_GUINT64_FORMAT "\n"
+                            "limit.admitted: %" G_GUINT64_FORMAT "\n"
+                            "limit.rejected_rate: %" G_GUINT64_FORMAT "\n"
+                            "limit.rejected_upload: %" G_GUINT64_FORMAT "\n"
+                            "limit.rejected_streams: %" G_GUINT64_FORMAT "\n"
+                            "limit.rejected_buffered: %" G_GUINT64_FORMAT "\n"
+                            "limit.rejected_429: %" G_GUINT64_FORMAT "\n"
+                            "limit.rejected_503: %" G_GUINT64_FORMAT "\n",
+                            limit.clients,
+                            limit.requests,
+                            limit.streams,
+                            limit.buffered,
+                            limit.admitted,
+                            limit.rejected_rate,
+                            limit.rejected_upload,
+                            limit.rejected_streams,
+                            limit.rejected_buffered,
+                            limit.rejected_client,
+                            limit.rejected_global);
+    soup_message_set_status (msg,
+                             SOUP_STATUS_OK);
+    soup_message_set_response (msg,
+                               "text/plain",
+                               SOUP_MEMORY_TAKE,
+                               body->str,
+                               body->len);
+    g_string_free (body,
+                   FALSE);
+    TraceEnd (&span);
+}
+
+/*
+ * trace服务，返回环形缓冲区中的事件，保存后用chrome://tracing或Perfetto打开
+ */
+void TraceHandler (SoupServer        *server,
+                   SoupMessage       *msg,
+                   char const        *path,
+                   GHashTable        *query,
+                   SoupClientContext *client,
+                   gpointer          user_data)
+{
+    GBytes *dump   = TraceDump ();
+    gsize   length;
+    gchar  *body   = g_bytes_unref_to_data (dump,
+                                           &length);
+    soup_message_set_status (msg,
+                             SOUP_STATUS_OK);
+    soup_message_set_response (msg,
+                               "application/json",
+                               SOUP_MEMORY_TAKE,
+                               body,
+                               length);
+}
+
+void TraceWritten (GBytes  *data,
+                   GError  *error,
+                   gpointer user_data)
+{
+    gchar *filename = (gchar *)user_data;
+    if (error)
+        LOG_WARNING ("Can't write trace to %s: %s",
+                     filename,
+                     error->message);
+    else
+        LOG_INFO ("跟踪事件已写入%s。",
+                  filename);
+    g_free (filename);
+}
+
+/*
+ * 收到SIGUSR1时把跟踪事件写入临时目录，文件由io_pool写入
+ */
+gboolean TraceSignal (gpointer user_data)
+{
+    gchar  *name     = g_strdup_printf ("soup_example-trace-%d.json",
+                                        getpid ());
+    gchar  *filename = g_build_filename (g_get_tmp_dir (),
+                                         name,
+                                         NULL);
+    GBytes *dump     = TraceDump ();
+    if (!IoPoolWrite (filename,
+                      dump,
+                      TraceWritten,
+                      filename))
+    {
+        LOG_WARNING ("Can't write trace to %s: io pool is full",
+                     filename);
+        g_free (filename);
+    }
+    g_bytes_unref (dump);
+    g_free (name);
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * /ws的握手在主循环中完成，101应答写出后把连接交给音频线程。
+ * SoupWebsocketConnection在音频线程中创建，它的信号、UDP通道和定时器都在音频线程的
+ * GMainContext中执行，不再受主循环中慢速HTTP处理函数的影响。
+ * 音频线程没有启动时RtThreadContext()为NULL，连接留在主循环中。
+ */
+typedef struct
+{
+    WsInfo            *info;
+    SoupClientContext *client;
+    GIOStream         *stream;
+    SoupURI           *uri;
+    gchar             *origin;
+} WsUpgrade;
+
+void WsUpgradeFree (gpointer data)
+{
+    WsUpgrade *upgrade = (WsUpgrade *)data;
+    g_clear_object (&upgrade->stream);
+    g_clear_pointer (&upgrade->uri,
+                     soup_uri_free);
+    g_free (upgrade->origin);
+    g_free (upgrade);
+}
+
+/*
+ * 在音频线程中执行
+ */
+gboolean WsStart (gpointer user_data)
+{
+    TraceSpan  span    = TraceBegin ("ws.start");
+    WsUpgrade *upgrade = (WsUpgrade *)user_data;
+    SoupWebsocketConnection *connection = soup_websocket_connection_new (upgrade->stream,
+                                                                         upgrade->uri,
+                                                                         SOUP_WEBSOCKET_CONNECTION_SERVER,
+                                                                         upgrade->origin,
+                                                                         NULL);
     ConnectionInit (connection,
-                    info->playback_device,
-                    info->capture_device);
+                    upgrade->info->playback_device,
+                    upgrade->info->capture_device);
+    g_object_unref (connection);
+    TraceEnd (&span);
+    return G_SOURCE_REMOVE;
+}
+
+void WsUpgraded (SoupMessage *msg,
+                 gpointer     user_data)
+{
+    WsUpgrade *upgrade = (WsUpgrade *)user_data;
+    g_signal_handlers_disconnect_by_data (msg,
+                                          upgrade);
+    upgrade->stream = soup_client_context_steal_connection (upgrade->client);
+    upgrade->client = NULL;
+    g_main_context_invoke_full (RtThreadContext (),
+                                G_PRIORITY_DEFAULT,
+                                WsStart,
+                                upgrade,
+                                WsUpgradeFree);
+}
+
+/*
+ * 101应答没有写出(如客户端已断开)时不会升级，在这里释放
+ */
+void WsUpgradeFinished (SoupMessage *msg,
+                        gpointer     user_data)
+{
+    WsUpgrade *upgrade = (WsUpgrade *)user_data;
+    g_signal_handlers_disconnect_by_data (msg,
+                                          upgrade);
+    WsUpgradeFree (upgrade);
+}
+
+void WsHandler (SoupServer        *server,
+                SoupMessage       *msg,
+                char const        *path,
+                GHashTable        *query,
+                SoupClientContext *client,
+                gpointer           user_data)
+{
+    TraceSpan span = TraceBegin ("http.ws");
+/*
+ * 握手失败时由libsoup设置相应的错误状态
+ */
+    if (!soup_websocket_server_process_handshake (msg,
+                                                  NULL,
+                                                  NULL))
+    {
+        TraceEnd (&span);
+        return;
+    }
+    WsUpgrade *upgrade = g_new0 (WsUpgrade, 1);
+    upgrade->info = (WsInfo *)user_data;
+    upgrade->client = client;
+    upgrade->uri = soup_uri_copy (soup_message_get_uri (msg));
+    upgrade->origin = g_strdup (soup_message_headers_get_one (msg->request_headers,
+                                                              "Origin"));
+    g_signal_connect (msg,
+                      "wrote-informational",
+                      G_CALLBACK (WsUpgraded),
+                      upgrade);
+    g_signal_connect (msg,
+                      "finished",
+                      G_CALLBACK (WsUpgradeFinished),
+                      upgrade);
+    TraceEnd (&span);
+}
+
+gboolean IsSocket (const char *path)
+{
+    GStatBuf buf;
+    return g_lstat (path,
+                    &buf) == 0
+        && S_ISSOCK (buf.st_mode);
+}
+
+/*
+ * 删除上次运行留下的套接字文件
+ * 路径不是套接字(如写错了路径)或者还有服务器在上面监听时不删除，返回FALSE
+ */
+gboolean RemoveStaleSocket (const char  *path,
+                            GError     **error)
+{
+    GStatBuf buf;
+    if (g_lstat (path,
+                 &buf) != 0)
+        return TRUE;
+    if (!S_ISSOCK (buf.st_mode))
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_EXISTS,
+                     "%s exists and is not a socket",
+                     path);
+        return FALSE;
+    }
+    GSocket *probe = g_socket_new (G_SOCKET_FAMILY_UNIX,
+                                   G_SOCKET_TYPE_STREAM,
+                                   G_SOCKET_PROTOCOL_DEFAULT,
+                                   error);
+    if (!probe)
+        return FALSE;
+    GSocketAddress *address = g_unix_socket_address_new (path);
+    gboolean        live    = g_socket_connect (probe,
+                                                address,
+                                                NULL,
+                                                NULL);
+    g_object_unref (address);
+    g_object_unref (probe);
+    if (live)
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_ADDRESS_IN_USE,
+                     "%s is in use by another server",
+                     path);
+        return FALSE;
+    }
+    g_unlink (path);
+    return TRUE;
+}
+
+/*
+ * Unix域套接字监听
+ * 同一主机上的客户端通过它访问，省去TCP回环的开销
+ */
+gboolean ListenUnix (SoupServer  *server,
+                     const char  *path,
+                     GError     **error)
+{
+    if (!RemoveStaleSocket (path,
+                            error))
+        return FALSE;
+    GSocket *socket = g_socket_new (G_SOCKET_FAMILY_UNIX,
+                                    G_SOCKET_TYPE_STREAM,
+                                    G_SOCKET_PROTOCOL_DEFAULT,
+                                    error);
+    if (!socket)
+        return FALSE;
+    GSocketAddress *address = g_unix_socket_address_new (path);
+    gboolean ok = g_socket_bind (socket,
+                                 address,
+                                 TRUE,
+                                 error)
+               && g_socket_listen (socket,
+                                   error)
+               && soup_server_listen_socket (server,
+                                             socket,
+                                             0,
+                                             error);
+    g_object_unref (address);
+    g_object_unref (socket);
+    return ok;
+}
+
+static gchar *socket_path = NULL;
+static gchar *tls_cert    = NULL;
+static gchar *tls_key     = NULL;
+static gint   https_port  = DEFAULT_HTTPS_PORT;
+static gboolean trace    = FALSE;
+static gint   stall_ms    = DEFAULT_STALL_MS;
+static gint   thumb_cache = DEFAULT_THUMB_CACHE_MB;
+static gchar *log_name    = NULL;
+static RtPolicy rt_policy = { 0, 0, -1 };
+
+/*
+ * 所有注册了处理函数的路径，增加服务时要同时加在这里，否则不经过准入控制
+ */
+static GOptionEntry entries[] =
+{
+    { "socket", 'u', 0, G_OPTION_ARG_FILENAME, &socket_path,
+      "Unix域套接字路径，默认为" DEFAULT_SOCKET "，为空时不监听", "PATH" },
+    { "tls-cert", 0, 0, G_OPTION_ARG_FILENAME, &tls_cert,
+      "PEM格式的证书，指定后同时提供HTTPS/WSS服务", "FILE" },
+    { "tls-key", 0, 0, G_OPTION_ARG_FILENAME, &tls_key,
+      "PEM格式的私钥，默认从证书文件中读取", "FILE" },
+    { "https-port", 0, 0, G_OPTION_ARG_INT, &https_port,
+      "HTTPS端口，默认为1443", "PORT" },
+    { "busy-poll", 0, 0, G_OPTION_ARG_INT, &sock_profile_audio.busy_poll,
+      "音频连接的SO_BUSY_POLL(微秒)，默认不启用", "USEC" },
+    { "no-sock-tuning", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &sock_tuning,
+      "不设置任何套接字参数", NULL },
+    { "no-udp", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &udp_enabled,
+      "音频只走WebSocket，不协商UDP旁路", NULL },
+    { "udp-loss", 0, 0, G_OPTION_ARG_DOUBLE, &udp_emulate_loss,
+      "模拟UDP丢包率(百分比)，用于回环测试", "PERCENT" },
+    { "udp-delay", 0, 0, G_OPTION_ARG_INT, &udp_emulate_delay,
+      "模拟UDP延迟(毫秒)，用于回环测试", "MS" },
+    { "trace", 0, 0, G_OPTION_ARG_NONE, &trace,
+      "记录处理函数、声卡回调和Opus编解码的耗时，通过/trace或SIGUSR1导出", NULL },
+    { "stall-ms", 0, 0, G_OPTION_ARG_INT, &stall_ms,
+      "主循环阻塞超过该值(毫秒)时打印调用栈，默认为50，为0时不检测", "MS" },
+    { "thumb-cache", 0, 0, G_OPTION_ARG_INT, &thumb_cache,
+      "缩略图缓存的大小(MB)，默认为16，为0时不缓存", "MB" },
+    { "log-level", 0, 0, G_OPTION_ARG_STRING, &log_name,
+      "日志级别：error、warning、info(默认)、debug", "LEVEL" },
+    { "rt-priority", 0, 0, G_OPTION_ARG_INT, &rt_policy.priority,
+      "音频线程使用SCHED_FIFO及该优先级(1-99)，默认不使用实时调度", "PRIO" },
+    { "rt-nice", 0, 0, G_OPTION_ARG_INT, &rt_policy.nice,
+      "不使用实时调度时音频线程的nice值，如-10", "NICE" },
+    { "rt-cpu", 0, 0, G_OPTION_ARG_INT, &rt_policy.cpu,
+      "把音频线程绑定到该CPU，默认不绑定", "CPU" },
+    { "limit-rate", 0, 0, G_OPTION_ARG_INT, &limit_config.rate,
+      "每个IP每秒的请求数，默认为50，为0时不限制", "N" },
+    { "limit-global-rate", 0, 0, G_OPTION_ARG_INT, &limit_config.global_rate,
+      "全局每秒的请求数，默认为500", "N" },
+    { "limit-upload", 0, 0, G_OPTION_ARG_INT, &limit_config.upload,
+      "每个IP每秒上传的KB，默认为8192", "KB" },
+    { "limit-global-upload", 0, 0, G_OPTION_ARG_INT, &limit_config.global_upload,
+      "全局每秒上传的KB，默认为32768", "KB" },
+    { "limit-streams", 0, 0, G_OPTION_ARG_INT, &limit_config.streams,
+      "每个IP在/mjpeg、/listen上各自的并发数，默认为8", "N" },
+    { "limit-global-streams", 0, 0, G_OPTION_ARG_INT, &limit_config.global_streams,
+      "/mjpeg、/listen各自的全局并发数，默认为512", "N" },
+    { "limit-buffered", 0, 0, G_OPTION_ARG_INT, &limit_config.buffered,
+      "未写出的应答超过该值(MB)时拒绝新请求，默认为64", "MB" },
+    { NULL }
+};
+
+void EchoMessage (SoupWebsocketConnection *connection,
+                  gint                     type,
+                  GBytes                  *message,
+                  gpointer                 user_data)
+{
+    TraceSpan span = TraceBegin ("ws.echo");
+    gsize         size;
+    gconstpointer data = g_bytes_get_data (message,
+                                          &size);
+    if (type == SOUP_WEBSOCKET_DATA_BINARY)
+        soup_websocket_connection_send_binary (connection,
+                                               data,
+                                               size);
+    else
+    {
+        gchar *text = g_strndup (data,
+                                 size);
+        soup_websocket_connection_send_text (connection,
+                                             text);
+        g_free (text);
+    }
+    TraceEnd (&span);
+}
+
+void EchoClose (SoupWebsocketConnection *connection,
+                gpointer                 user_data)
+{
+    g_object_unref (connection);
+}
+
+/*
+ * echo服务，原样返回收到的每个WebSocket消息，用于测量ws/wss的往返开销
+ * 与/ws一样使用音频的套接字参数，/echo/raw保持系统默认
+ */
+void EchoHandler (SoupServer *server,
+                  SoupWebsocketConnection *connection,
+                  const char *path,
+                  SoupClientContext *client,
+                  gpointer user_data)
+{
+    if (!g_str_has_suffix (path,
+                           "/raw"))
+        SockProfileApply (SockStreamFd (soup_websocket_connection_get_io_stream (connection)),
+                          &sock_profile_audio);
+    g_signal_connect (connection,
+                      "message",
+                      G_CALLBACK (EchoMessage),
+                      NULL);
+    g_signal_connect (connection,
+                      "closed",
+                      G_CALLBACK (EchoClose),
+                      NULL);
+    g_object_ref (connection);
 }
 
 int main(int argc, char *argv[])
 {
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new ("<放音设备> <采音设备>");
+    g_option_context_add_main_entries (context,
+                                       entries,
+                                       NULL);
+    if (!g_option_context_parse (context,
+                                &argc,
+                                &argv,
+                                &error))
+    {
+        fprintf (stderr,
+                 "%s\n",
+                 error->message);
+        g_error_free (error);
+        error = NULL;
+        goto err_usage;
+    }
+    if (log_name
+    && !LogSetLevel (log_name))
+    {
+        fprintf (stderr,
+                 "Unknown log level: %s\n",
+                 log_name);
+        goto err_usage;
+    }
+    if (!socket_path)
+        socket_path = g_strdup (DEFAULT_SOCKET);
     if (argc != 3)
     {
-        printf ("Usage: %s <放音设备> <采音设备>\n",
+        printf ("Usage: %s [选项] <放音设备> <采音设备>\n",
                 argv[0]);
         SDL_Init(SDL_INIT_AUDIO);
         puts ("放音设备:");
@@ -245,8 +1001,31 @@ int main(int argc, char *argv[])
         SDL_Quit();
         goto err_usage;
     }
+/*
+ * 会话恢复由GIO的TLS后端(glib-networking)完成：
+ * 服务端签发session ticket，客户端在同一进程内的后续连接中复用
+ */
+    GTlsCertificate *certificate = NULL;
+    if (tls_cert)
+    {
+        certificate = g_tls_certificate_new_from_files (tls_cert,
+                                                        tls_key ? tls_key : tls_cert,
+                                                       &error);
+        if (error)
+        {
+            fprintf (stderr,
+                     "Can't load certificate %s: %s\n",
+                     tls_cert,
+                     error->message);
+            g_error_free (error);
+            error = NULL;
+            goto err_usage;
+        }
+    }
     SoupServer *server = soup_server_new(SOUP_SERVER_SERVER_HEADER,
                                          "Soup Example Server",
+                                         SOUP_SERVER_TLS_CERTIFICATE,
+                                         certificate,
                                          NULL);
 
     if (!server)
@@ -255,7 +1034,36 @@ int main(int argc, char *argv[])
                  "Error on SoupServer new.\n");
         goto err_server;
     }
-    GError *error = NULL;
+/*
+ * 日志由后台线程输出，处理函数和声卡回调不会阻塞在终端或管道上
+ */
+    LogInit ();
+/*
+ * 文件读写都交给io_pool，避免慢速磁盘阻塞主循环
+ */
+    if (!IoPoolInit (IO_POOL_THREADS,
+                     IO_POOL_QUEUE))
+        goto err_pool;
+/*
+ * 心跳与看门狗始终运行，区间只在--trace时记录
+ */
+    TraceInit (MAX (stall_ms, 0),
+               trace ? TRACE_EVENTS : 0);
+    g_unix_signal_add (SIGUSR1,
+                       TraceSignal,
+                       NULL);
+    ThumbInit ((gsize)MAX (thumb_cache, 0) * 1024 * 1024);
+/*
+ * WebSocket音频连接在握手后交给音频线程，启动失败时留在主循环中
+ */
+    if (!RtThreadStart ("audio",
+                        &rt_policy))
+        LOG_WARNING ("音频连接将在主循环中处理。");
+/*
+ * 准入控制在所有处理函数之前，读完请求头时执行
+ * 处理函数都通过LimitAddHandler注册，同时注册准入检查
+ */
+    LimitInit (server);
     soup_server_listen_all (server,
                             1080,
                             0,
@@ -269,48 +1077,106 @@ int main(int argc, char *argv[])
         error = NULL;
         goto err_listen;
     }
-    soup_server_add_handler(server,
-                            "/get",
-                            GetHandler,
-                            NULL,
-                            NULL);
-    soup_server_add_handler(server,
-                            "/image",
-                            ImageHandler,
-                            NULL,
-                            NULL);
-    soup_server_add_handler(server,
-                            "/post",
-                            PostHandler,
-                            NULL,
-                            NULL);
-    soup_server_add_handler(server,
-                            "/mjpeg",
-                            MjpegHandler,
-                            NULL,
-                            NULL);
+    if (*socket_path
+    && !ListenUnix (server,
+                    socket_path,
+                   &error))
+    {
+        fprintf (stderr,
+                 "Error on SoupServer listen %s: %s\n",
+                 socket_path,
+                 error->message);
+        g_error_free (error);
+        error = NULL;
+        goto err_listen;
+    }
+    if (certificate)
+    {
+        soup_server_listen_all (server,
+                                https_port,
+                                SOUP_SERVER_LISTEN_HTTPS,
+                               &error);
+        if (error)
+        {
+            fprintf (stderr,
+                     "Error on SoupServer listen https: %s\n",
+                     error->message);
+            g_error_free (error);
+            error = NULL;
+            goto err_listen;
+        }
+    }
+    LimitAddHandler (server,
+                     "/get",
+                     GetHandler,
+                     NULL,
+                     NULL);
+    LimitAddHandler (server,
+                     "/image",
+                     ImageHandler,
+                     NULL,
+                     NULL);
+    LimitAddHandler (server,
+                     "/post",
+                     PostHandler,
+                     NULL,
+                     NULL);
+    LimitAddHandler (server,
+                     "/mjpeg",
+                     MjpegHandler,
+                     NULL,
+                     NULL);
+    LimitAddHandler (server,
+                     "/stats",
+                     StatsHandler,
+                     NULL,
+                     NULL);
+    LimitAddHandler (server,
+                     "/trace",
+                     TraceHandler,
+                     NULL,
+                     NULL);
 /*
  * WsInfo的内容包括放音设备和采音设备
  */
     WsInfo *info = malloc (sizeof (WsInfo));
     info->playback_device = argv[1];
     info->capture_device = argv[2];
-    soup_server_add_websocket_handler (server,
-                                       "/ws",
-                                       NULL,
-                                       NULL,
-                                       WsHandler,
-                                       info,
-                                       NULL);
+    LimitAddHandler (server,
+                     "/ws",
+                     WsHandler,
+                     info,
+                     NULL);
+    LimitAddHandler (server,
+                     "/listen",
+                     ListenHandler,
+                     info,
+                     NULL);
+
+    LimitAddWebsocketHandler (server,
+                              "/echo",
+                              NULL,
+                              NULL,
+                              EchoHandler,
+                              NULL,
+                              NULL);
 
     GMainLoop *loop =  g_main_loop_new(NULL,
                                        FALSE);
     g_main_loop_run(loop);
 
     // clean up
+    soup_server_remove_handler (server,
+                                "/echo");
+    soup_server_remove_handler (server,
+                                "/listen");
     soup_server_remove_handler (server,
                                 "/ws");
     free (info);
+    soup_server_remove_handler (server,
+                                "/trace");
+    soup_server_remove_handler (server,
+                                "/stats");
     soup_server_remove_handler (server,
                                 "/mjpeg");
     soup_server_remove_handler (server,
@@ -321,9 +1187,25 @@ int main(int argc, char *argv[])
                                 "/get");
     g_main_loop_unref(loop);
 
+    if (*socket_path
+    && IsSocket (socket_path))
+        g_unlink (socket_path);
 err_listen:
+    RtThreadStop ();
+    TraceShutdown ();
+    IoPoolShutdown ();
+    ThumbShutdown ();
+err_pool:
+    LogShutdown ();
     g_object_unref(server);
+    LimitShutdown ();
 err_server:
+    g_clear_object (&certificate);
 err_usage:
+    g_free (socket_path);
+    g_free (tls_cert);
+    g_free (tls_key);
+    g_free (log_name);
+    g_option_context_free (context);
     return 0;
 }
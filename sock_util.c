@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <gio/gio.h>
+#include "sock_util.h"
+#include "log_util.h"
+
+#define DSCP_EF  (46 << 2)
+#define DSCP_CS1 (8 << 2)
+
+SockProfile sock_profile_audio =
+{
+    .name          = "audio",
+    .nodelay       = TRUE,
+    .notsent_lowat = 16 * 1024,
+    .sndbuf        = 64 * 1024,
+    .rcvbuf        = 64 * 1024,
+    .priority      = 6,
+    .tos           = DSCP_EF,
+    .busy_poll     = 0,
+};
+
+SockProfile sock_profile_bulk =
+{
+    .name          = "bulk",
+    .nodelay       = FALSE,
+    .notsent_lowat = 128 * 1024,
+    .sndbuf        = 0,
+    .rcvbuf        = 0,
+    .priority      = -1,
+    .tos           = DSCP_CS1,
+    .busy_poll     = 0,
+};
+
+/*
+ * 为FALSE时不做任何设置，用于对比测试
+ */
+gboolean sock_tuning = TRUE;
+
+static gboolean SockSet (int         fd,
+                         int         level,
+                         int         option,
+                         int         value,
+                         const char *name,
+                         const char *profile)
+{
+    if (setsockopt (fd,
+                    level,
+                    option,
+                   &value,
+                    sizeof (value)) == 0)
+        return TRUE;
+    LOG_WARNING ("[%s] setsockopt %s=%d: %s",
+                 profile,
+                 name,
+                 value,
+                 strerror (errno));
+    return FALSE;
+}
+
+/*
+ * Unix域套接字只设置缓冲区大小
+ * 某一项设置失败不影响其他项，返回值表示是否全部成功
+ */
+gboolean SockProfileApply (int                fd,
+                           const SockProfile *profile)
+{
+    if (!sock_tuning
+    || fd < 0)
+        return FALSE;
+
+    struct sockaddr_storage address;
+    socklen_t               length = sizeof (address);
+    if (getsockname (fd,
+                     (struct sockaddr *)&address,
+                    &length) < 0)
+        return FALSE;
+    gboolean inet = address.ss_family == AF_INET
+                 || address.ss_family == AF_INET6;
+    gboolean ok   = TRUE;
+
+    if (profile->sndbuf)
+        ok &= SockSet (fd, SOL_SOCKET, SO_SNDBUF, profile->sndbuf, "SO_SNDBUF", profile->name);
+    if (profile->rcvbuf)
+        ok &= SockSet (fd, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf, "SO_RCVBUF", profile->name);
+    if (!inet)
+        return ok;
+
+    ok &= SockSet (fd, IPPROTO_TCP, TCP_NODELAY, profile->nodelay, "TCP_NODELAY", profile->name);
+#ifdef TCP_NOTSENT_LOWAT
+    if (profile->notsent_lowat)
+        ok &= SockSet (fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile->notsent_lowat, "TCP_NOTSENT_LOWAT", profile->name);
+#endif
+#ifdef SO_PRIORITY
+    if (profile->priority >= 0)
+        ok &= SockSet (fd, SOL_SOCKET, SO_PRIORITY, profile->priority, "SO_PRIORITY", profile->name);
+#endif
+    if (profile->tos >= 0)
+    {
+        if (address.ss_family == AF_INET6)
+            ok &= SockSet (fd, IPPROTO_IPV6, IPV6_TCLASS, profile->tos, "IPV6_TCLASS", profile->name);
+        else
+            ok &= SockSet (fd, IPPROTO_IP, IP_TOS, profile->tos, "IP_TOS", profile->name);
+    }
+#ifdef SO_BUSY_POLL
+    if (profile->busy_poll)
+        ok &= SockSet (fd, SOL_SOCKET, SO_BUSY_POLL, profile->busy_poll, "SO_BUSY_POLL", profile->name);
+#endif
+    return ok;
+}
+
+/*
+ * 取得连接底层的GSocket，TLS连接取其下层连接的
+ * libsoup交出的WebSocket连接把GSocket放在对象数据"GSocket"中
+ */
+GSocket *SockStreamSocket (GIOStream *stream)
+{
+    GSocket *socket = g_object_get_data (G_OBJECT (stream),
+                                         "GSocket");
+    if (socket)
+        return socket;
+    if (G_IS_TLS_CONNECTION (stream))
+    {
+        GIOStream *base = NULL;
+        g_object_get (stream,
+                      "base-io-stream",
+                     &base,
+                      NULL);
+        if (base)
+        {
+            socket = SockStreamSocket (base);
+            g_object_unref (base);
+        }
+    }
+    else if (G_IS_SOCKET_CONNECTION (stream))
+        socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (stream));
+    return socket;
+}
+
+int SockStreamFd (GIOStream *stream)
+{
+    GSocket *socket = SockStreamSocket (stream);
+    return socket ? g_socket_get_fd (socket) : -1;
+}
@@ -0,0 +1,35 @@
+#ifndef _SOCK_UTIL_H
+#define _SOCK_UTIL_H
+
+#include <gio/gio.h>
+
+/*
+ * 按端点设置的套接字参数
+ * 值为0(priority、tos为-1)的项保持系统默认
+ */
+typedef struct
+{
+    const char *name;
+    gboolean    nodelay;        /* TCP_NODELAY */
+    int         notsent_lowat;  /* TCP_NOTSENT_LOWAT，字节 */
+    int         sndbuf;         /* SO_SNDBUF，字节，设置后内核不再自动调整 */
+    int         rcvbuf;         /* SO_RCVBUF，字节 */
+    int         priority;       /* SO_PRIORITY */
+    int         tos;            /* IP_TOS / IPV6_TCLASS */
+    int         busy_poll;      /* SO_BUSY_POLL，微秒 */
+} SockProfile;
+
+/*
+ * audio：WebSocket音频，小包立即发出，DSCP EF
+ * bulk ：图片和MJPEG，限制未发送数据量，DSCP CS1，让路给音频
+ */
+extern SockProfile sock_profile_audio;
+extern SockProfile sock_profile_bulk;
+extern gboolean    sock_tuning;
+
+gboolean SockProfileApply (int                fd,
+                           const SockProfile *profile);
+GSocket *SockStreamSocket (GIOStream *stream);
+int SockStreamFd (GIOStream *stream);
+
+#endif
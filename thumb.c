@@ -0,0 +1,507 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <gio/gio.h>
+#include "io_pool.h"
+#include "thumb.h"
+
+/*
+ * 源文件，version在文件变化时递增，旧版本的缓存项随之作废
+ */
+typedef struct
+{
+    gchar        *filename;
+    guint         version;
+    GFileMonitor *monitor;
+} ThumbSource;
+
+typedef struct
+{
+    gchar       *key;
+    ThumbSource *source;
+    guint        version;
+    GBytes      *jpeg;
+} ThumbEntry;
+
+typedef struct
+{
+    ThumbCallback callback;
+    gpointer      user_data;
+} ThumbWaiter;
+
+/*
+ * 正在编码的缩略图，后来的相同请求挂在waiters上
+ */
+typedef struct
+{
+    gchar       *key;
+    ThumbSource *source;
+    guint        version;
+    GSList      *waiters;
+} ThumbInflight;
+
+typedef struct
+{
+    gchar *filename;
+    int    width;
+    int    height;
+    int    quality;
+} ThumbJob;
+
+typedef struct
+{
+    struct jpeg_error_mgr manager;
+    jmp_buf               jump;
+    char                  message[JMSG_LENGTH_MAX];
+} ThumbJpegError;
+
+typedef struct
+{
+    struct jpeg_decompress_struct decompress;
+    struct jpeg_compress_struct   compress;
+    ThumbJpegError                error;
+    guchar                       *pixels;
+    guchar                       *shrunk;
+    unsigned char                *output;
+    unsigned long                 size;
+} ThumbWork;
+
+static GHashTable *sources  = NULL;
+static GHashTable *entries  = NULL;
+static GHashTable *inflight = NULL;
+static GQueue      lru      = G_QUEUE_INIT;
+static ThumbStats  stats;
+
+/*
+ * 以下在io_pool的工作线程中执行
+ */
+static void ThumbJpegExit (j_common_ptr cinfo)
+{
+    ThumbJpegError *error = (ThumbJpegError *)cinfo->err;
+    cinfo->err->format_message (cinfo,
+                                error->message);
+    longjmp (error->jump,
+             1);
+}
+
+/*
+ * 区域平均，DCT缩放后剩下的比例都小于2，每个输出像素只涉及少数几个输入像素
+ */
+static void ThumbShrink (const guchar *in,
+                         int           in_width,
+                         int           in_height,
+                         guchar       *out,
+                         int           out_width,
+                         int           out_height,
+                         int           components)
+{
+    for (int y = 0; y < out_height; y++)
+    {
+        int y0 = y * in_height / out_height;
+        int y1 = MAX ((y + 1) * in_height / out_height, y0 + 1);
+        for (int x = 0; x < out_width; x++)
+        {
+            int x0 = x * in_width / out_width;
+            int x1 = MAX ((x + 1) * in_width / out_width, x0 + 1);
+            int n  = (y1 - y0) * (x1 - x0);
+            for (int c = 0; c < components; c++)
+            {
+                int sum = 0;
+                for (int sy = y0; sy < y1; sy++)
+                    for (int sx = x0; sx < x1; sx++)
+                        sum += in[(sy * in_width + sx) * components + c];
+                out[(y * out_width + x) * components + c] = (sum + n / 2) / n;
+            }
+        }
+    }
+}
+
+static GBytes *ThumbEncodeFunc (gpointer  job_data,
+                                GError  **error)
+{
+    ThumbJob *job  = (ThumbJob *)job_data;
+    gchar    *data = NULL;
+    gsize     length;
+    if (!g_file_get_contents (job->filename,
+                              &data,
+                              &length,
+                              error))
+        return NULL;
+
+/*
+ * longjmp之后仍要用到的状态都放在work中，避免局部变量在setjmp之后失效
+ */
+    ThumbWork *work   = g_new0 (ThumbWork, 1);
+    GBytes    *result = NULL;
+    work->decompress.err = jpeg_std_error (&work->error.manager);
+    work->compress.err = &work->error.manager;
+    work->error.manager.error_exit = ThumbJpegExit;
+    if (setjmp (work->error.jump))
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_INVALID_DATA,
+                     "%s: %s",
+                     job->filename,
+                     work->error.message);
+        goto done;
+    }
+    jpeg_create_decompress (&work->decompress);
+    jpeg_create_compress (&work->compress);
+    jpeg_mem_src (&work->decompress,
+                  (unsigned char *)data,
+                  length);
+    jpeg_read_header (&work->decompress,
+                      TRUE);
+
+/*
+ * 目标尺寸：在width×height内保持宽高比，不放大
+ */
+    int    source_width  = work->decompress.image_width;
+    int    source_height = work->decompress.image_height;
+    double scale         = 1.0;
+    if (job->width)
+        scale = MIN (scale, (double)job->width / source_width);
+    if (job->height)
+        scale = MIN (scale, (double)job->height / source_height);
+    int width  = MAX ((int)(source_width * scale + 0.5), 1);
+    int height = MAX ((int)(source_height * scale + 0.5), 1);
+
+/*
+ * 选不小于目标尺寸的最大缩小倍数，在DCT域中完成大部分缩放
+ */
+    work->decompress.scale_num = 1;
+    for (int denom = 8; denom >= 1; denom /= 2)
+    {
+        if ((source_width + denom - 1) / denom >= width
+        && (source_height + denom - 1) / denom >= height)
+        {
+            work->decompress.scale_denom = denom;
+            break;
+        }
+    }
+    work->decompress.dct_method = JDCT_ISLOW;
+    if (work->decompress.num_components == 1)
+        work->decompress.out_color_space = JCS_GRAYSCALE;
+    else
+        work->decompress.out_color_space = JCS_RGB;
+    jpeg_start_decompress (&work->decompress);
+
+    int decoded_width  = work->decompress.output_width;
+    int decoded_height = work->decompress.output_height;
+    int components     = work->decompress.output_components;
+    int stride         = decoded_width * components;
+    work->pixels = g_malloc ((gsize)stride * decoded_height);
+    while (work->decompress.output_scanline < work->decompress.output_height)
+    {
+        JSAMPROW row = work->pixels + (gsize)work->decompress.output_scanline * stride;
+        jpeg_read_scanlines (&work->decompress,
+                             &row,
+                             1);
+    }
+    jpeg_finish_decompress (&work->decompress);
+
+    const guchar *image = work->pixels;
+    width  = MIN (width, decoded_width);
+    height = MIN (height, decoded_height);
+    if (width != decoded_width
+    || height != decoded_height)
+    {
+        work->shrunk = g_malloc ((gsize)width * height * components);
+        ThumbShrink (work->pixels,
+                     decoded_width,
+                     decoded_height,
+                     work->shrunk,
+                     width,
+                     height,
+                     components);
+        image = work->shrunk;
+    }
+
+    jpeg_mem_dest (&work->compress,
+                   &work->output,
+                   &work->size);
+    work->compress.image_width      = width;
+    work->compress.image_height     = height;
+    work->compress.input_components = components;
+    work->compress.in_color_space   = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults (&work->compress);
+    jpeg_set_quality (&work->compress,
+                      job->quality,
+                      TRUE);
+    jpeg_start_compress (&work->compress,
+                         TRUE);
+    while (work->compress.next_scanline < work->compress.image_height)
+    {
+        JSAMPROW row = (JSAMPROW)image + (gsize)work->compress.next_scanline * width * components;
+        jpeg_write_scanlines (&work->compress,
+                              &row,
+                              1);
+    }
+    jpeg_finish_compress (&work->compress);
+    result = g_bytes_new_with_free_func (work->output,
+                                         work->size,
+                                         free,
+                                         work->output);
+    work->output = NULL;
+
+done:
+    jpeg_destroy_compress (&work->compress);
+    jpeg_destroy_decompress (&work->decompress);
+    free (work->output);
+    g_free (work->shrunk);
+    g_free (work->pixels);
+    g_free (work);
+    g_free (data);
+    return result;
+}
+
+static void ThumbJobFree (gpointer data)
+{
+    ThumbJob *job = (ThumbJob *)data;
+    g_free (job->filename);
+    g_free (job);
+}
+
+/*
+ * 以下在主循环中执行
+ */
+static void ThumbEntryRemove (GList *link)
+{
+    ThumbEntry *entry = (ThumbEntry *)link->data;
+    g_queue_delete_link (&lru,
+                         link);
+    g_hash_table_remove (entries,
+                         entry->key);
+    stats.bytes -= g_bytes_get_size (entry->jpeg);
+    stats.entries--;
+    g_bytes_unref (entry->jpeg);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+static void ThumbSourceChanged (GFileMonitor      *monitor,
+                                GFile             *file,
+                                GFile             *other,
+                                GFileMonitorEvent  event,
+                                gpointer           user_data)
+{
+    ThumbSource *source = (ThumbSource *)user_data;
+    if (event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+        return;
+    source->version++;
+    for (GList *link = lru.head; link;)
+    {
+        GList *next = link->next;
+        if (((ThumbEntry *)link->data)->source == source)
+            ThumbEntryRemove (link);
+        link = next;
+    }
+}
+
+static ThumbSource *ThumbSourceGet (const char *filename)
+{
+    ThumbSource *source = g_hash_table_lookup (sources,
+                                               filename);
+    if (source)
+        return source;
+    source = g_new0 (ThumbSource, 1);
+    source->filename = g_strdup (filename);
+    GFile *file = g_file_new_for_path (filename);
+    source->monitor = g_file_monitor_file (file,
+                                           G_FILE_MONITOR_NONE,
+                                           NULL,
+                                           NULL);
+    g_object_unref (file);
+    if (source->monitor)
+        g_signal_connect (source->monitor,
+                          "changed",
+                          G_CALLBACK (ThumbSourceChanged),
+                          source);
+    g_hash_table_insert (sources,
+                         source->filename,
+                         source);
+    return source;
+}
+
+static void ThumbSourceFree (gpointer data)
+{
+    ThumbSource *source = (ThumbSource *)data;
+    if (source->monitor)
+    {
+        g_file_monitor_cancel (source->monitor);
+        g_object_unref (source->monitor);
+    }
+    g_free (source->filename);
+    g_free (source);
+}
+
+static void ThumbCacheInsert (const char  *key,
+                              ThumbSource *source,
+                              guint        version,
+                              GBytes      *jpeg)
+{
+    gsize size = g_bytes_get_size (jpeg);
+    if (size > stats.max_bytes
+    || g_hash_table_contains (entries,
+                              key))
+        return;
+    while (stats.bytes + size > stats.max_bytes)
+    {
+        ThumbEntryRemove (lru.tail);
+        stats.evictions++;
+    }
+    ThumbEntry *entry = g_new0 (ThumbEntry, 1);
+    entry->key = g_strdup (key);
+    entry->source = source;
+    entry->version = version;
+    entry->jpeg = g_bytes_ref (jpeg);
+    g_queue_push_head (&lru,
+                       entry);
+    g_hash_table_insert (entries,
+                         entry->key,
+                         lru.head);
+    stats.bytes += size;
+    stats.entries++;
+}
+
+static void ThumbDone (GBytes  *jpeg,
+                       GError  *error,
+                       gpointer user_data)
+{
+    ThumbInflight *job = (ThumbInflight *)user_data;
+    g_hash_table_steal (inflight,
+                        job->key);
+/*
+ * 编码期间源文件变了，结果仍交给已在等待的请求，但不进缓存
+ */
+    if (jpeg
+    && job->version == job->source->version)
+        ThumbCacheInsert (job->key,
+                          job->source,
+                          job->version,
+                          jpeg);
+    job->waiters = g_slist_reverse (job->waiters);
+    for (GSList *item = job->waiters; item; item = item->next)
+    {
+        ThumbWaiter *waiter = (ThumbWaiter *)item->data;
+        waiter->callback (jpeg,
+                          error,
+                          waiter->user_data);
+    }
+    g_slist_free_full (job->waiters,
+                       g_free);
+    g_free (job->key);
+    g_free (job);
+}
+
+void ThumbInit (gsize max_bytes)
+{
+    sources = g_hash_table_new_full (g_str_hash,
+                                     g_str_equal,
+                                     NULL,
+                                     ThumbSourceFree);
+    entries = g_hash_table_new (g_str_hash,
+                                g_str_equal);
+    inflight = g_hash_table_new (g_str_hash,
+                                 g_str_equal);
+    memset (&stats, 0, sizeof (stats));
+    stats.max_bytes = max_bytes;
+}
+
+/*
+ * 在IoPoolShutdown之后调用，此时已没有正在编码的任务
+ */
+void ThumbShutdown (void)
+{
+    if (!sources)
+        return;
+    while (lru.head)
+        ThumbEntryRemove (lru.head);
+    g_hash_table_destroy (inflight);
+    g_hash_table_destroy (entries);
+    g_hash_table_destroy (sources);
+    inflight = entries = sources = NULL;
+}
+
+gboolean ThumbGet (const char    *filename,
+                   int            width,
+                   int            height,
+                   int            quality,
+                   ThumbCallback  callback,
+                   gpointer       user_data)
+{
+    ThumbSource *source = ThumbSourceGet (filename);
+    gchar       *key    = g_strdup_printf ("%s@%u:%dx%d:q%d",
+                                           filename,
+                                           source->version,
+                                           width,
+                                           height,
+                                           quality);
+    GList *link = g_hash_table_lookup (entries,
+                                       key);
+    if (link)
+    {
+        stats.hits++;
+        g_queue_unlink (&lru,
+                        link);
+        g_queue_push_head_link (&lru,
+                                link);
+        g_free (key);
+        callback (((ThumbEntry *)link->data)->jpeg,
+                  NULL,
+                  user_data);
+        return TRUE;
+    }
+
+    ThumbWaiter *waiter = g_new0 (ThumbWaiter, 1);
+    waiter->callback = callback;
+    waiter->user_data = user_data;
+    ThumbInflight *job = g_hash_table_lookup (inflight,
+                                              key);
+    if (job)
+    {
+        stats.collapsed++;
+        job->waiters = g_slist_prepend (job->waiters,
+                                        waiter);
+        g_free (key);
+        return TRUE;
+    }
+
+    ThumbJob *encode = g_new0 (ThumbJob, 1);
+    encode->filename = g_strdup (filename);
+    encode->width = width;
+    encode->height = height;
+    encode->quality = quality;
+    job = g_new0 (ThumbInflight, 1);
+    job->key = key;
+    job->source = source;
+    job->version = source->version;
+    job->waiters = g_slist_prepend (NULL,
+                                    waiter);
+    if (!IoPoolSubmit (ThumbEncodeFunc,
+                       encode,
+                       ThumbJobFree,
+                       ThumbDone,
+                       job))
+    {
+        g_slist_free_full (job->waiters,
+                           g_free);
+        g_free (job->key);
+        g_free (job);
+        return FALSE;
+    }
+    stats.misses++;
+    stats.encodes++;
+    g_hash_table_insert (inflight,
+                         job->key,
+                         job);
+    return TRUE;
+}
+
+void ThumbGetStats (ThumbStats *out)
+{
+    *out = stats;
+}
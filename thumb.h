@@ -0,0 +1,46 @@
+#ifndef _THUMB_H
+#define _THUMB_H
+
+#include <glib.h>
+
+/*
+ * JPEG缩略图
+ * 在io_pool中用libjpeg的DCT域缩放(1/2、1/4、1/8)解码，再做一次小比例的区域平均，
+ * 结果放在按字节数限制大小的LRU缓存中。
+ * 缓存键包含源文件的版本(由GFileMonitor在文件变化时递增)和宽、高、质量；
+ * 同一个尚未缓存的缩略图同时被多次请求时只编码一次。
+ * 所有函数都只能在主循环中调用。
+ */
+
+typedef void (*ThumbCallback) (GBytes  *jpeg,
+                               GError  *error,
+                               gpointer user_data);
+
+typedef struct
+{
+    guint  hits;
+    guint  misses;
+    guint  collapsed;
+    guint  encodes;
+    guint  evictions;
+    guint  entries;
+    gsize  bytes;
+    gsize  max_bytes;
+} ThumbStats;
+
+void ThumbInit (gsize max_bytes);
+void ThumbShutdown (void);
+/*
+ * width、height为0时按另一边等比例缩放，都为0时保持原尺寸，不放大
+ * 缓存命中时在本函数中直接调用callback，jpeg由调用者引用后才能保留
+ * io_pool已满时返回FALSE，不调用callback
+ */
+gboolean ThumbGet (const char    *filename,
+                   int            width,
+                   int            height,
+                   int            quality,
+                   ThumbCallback  callback,
+                   gpointer       user_data);
+void ThumbGetStats (ThumbStats *stats);
+
+#endif
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <glib.h>
+#include "trace.h"
+#include "log_util.h"
+
+#define HEARTBEAT_MS  10
+#define MAX_THREADS   64
+#define MAX_FRAMES    64
+
+/*
+ * 环形缓冲区中的一个区间
+ * seq在写完其他字段后才更新，导出时seq不符的项(正在被覆盖)直接跳过
+ */
+typedef struct
+{
+    guint       seq;
+    const char *name;
+    gint64      start;
+    gint64      dur;
+    gint        tid;
+} TraceEvent;
+
+static gboolean      active        = FALSE;
+static guint         stall_us      = 0;
+static TraceEvent   *ring          = NULL;
+static guint         ring_size     = 0;
+static guint         ring_head     = 0;
+static GSource      *heartbeat     = NULL;
+static GThread      *watchdog      = NULL;
+static GMutex        watchdog_lock;
+static GCond         watchdog_cond;
+static gboolean      watchdog_stop = FALSE;
+static pthread_t     main_thread;
+static const char   *main_span     = NULL;
+static gint64        last_beat     = 0;
+static gint64        stalled_beat  = 0;
+static GMutex        stats_lock;     /* 同时保护last_beat */
+static TraceStats    stats;
+
+static gint          thread_count  = 0;
+static char          thread_names[MAX_THREADS][16];
+static __thread gint thread_id     = 0;
+
+/*
+ * 线程编号从1开始，第一次记录时取线程名(SDL的声卡线程、GLib的线程池都有名字)
+ */
+static gint TraceThreadId (void)
+{
+    if (thread_id)
+        return thread_id;
+    thread_id = g_atomic_int_add (&thread_count, 1) + 1;
+    if (thread_id <= MAX_THREADS)
+        pthread_getname_np (pthread_self (),
+                            thread_names[thread_id - 1],
+                            sizeof (thread_names[0]));
+    return thread_id;
+}
+
+static void TraceRecord (const char *name,
+                         gint64      start,
+                         gint64      dur)
+{
+    guint       seq   = g_atomic_int_add (&ring_head, 1);
+    TraceEvent *event = &ring[seq % ring_size];
+    g_atomic_int_set (&event->seq,
+                      0);
+    event->name  = name;
+    event->start = start;
+    event->dur   = dur;
+    event->tid   = TraceThreadId ();
+    g_atomic_int_set (&event->seq,
+                      seq + 1);
+}
+
+/*
+ * SIGUSR2在主线程中执行，打印被阻塞时的调用栈
+ * backtrace_symbols_fd不分配内存，可以在信号处理中使用
+ */
+static void TraceBacktrace (int signum)
+{
+    void *frames[MAX_FRAMES];
+    int   count = backtrace (frames,
+                             MAX_FRAMES);
+    backtrace_symbols_fd (frames,
+                          count,
+                          STDERR_FILENO);
+}
+
+/*
+ * 在主循环中执行，期望每HEARTBEAT_MS执行一次，超出的部分就是调度延迟
+ */
+static gboolean TraceHeartbeat (gpointer user_data)
+{
+    gint64 now = g_get_monotonic_time ();
+    g_mutex_lock (&stats_lock);
+    gint64 last    = last_beat;
+    gint64 latency = last ? now - last - HEARTBEAT_MS * 1000 : 0;
+    if (latency < 0)
+        latency = 0;
+    last_beat = now;
+    stats.beats++;
+    stats.total_latency_us += latency;
+    if (latency > stats.max_latency_us)
+        stats.max_latency_us = latency;
+    if (stall_us
+    && latency > stall_us)
+        stats.stalls++;
+    g_mutex_unlock (&stats_lock);
+
+    if (stall_us
+    && latency > stall_us)
+    {
+        LOG_WARNING ("主循环恢复，阻塞了%" G_GINT64_FORMAT " ms。",
+                     latency / 1000);
+        if (ring)
+            TraceRecord ("main_loop.stall",
+                         last + HEARTBEAT_MS * 1000,
+                         latency);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * 看门狗线程，主循环超过阈值没有心跳时，每次阻塞只报告一次
+ * 随后的调用栈由信号处理直接写到stderr，这里也直接写，保证两者的先后顺序
+ */
+static gpointer TraceWatchdog (gpointer user_data)
+{
+    g_mutex_lock (&watchdog_lock);
+    while (!watchdog_stop)
+    {
+        g_cond_wait_until (&watchdog_cond,
+                           &watchdog_lock,
+                           g_get_monotonic_time () + stall_us / 2);
+        if (watchdog_stop)
+            break;
+        g_mutex_lock (&stats_lock);
+        gint64 last = last_beat;
+        g_mutex_unlock (&stats_lock);
+        gint64 late = g_get_monotonic_time () - last - HEARTBEAT_MS * 1000;
+        if (!last
+        || late <= stall_us
+        || last == stalled_beat)
+            continue;
+        stalled_beat = last;
+        const char *span = g_atomic_pointer_get (&main_span);
+        fprintf (stderr,
+                 "主循环已阻塞%" G_GINT64_FORMAT " ms，正在执行：%s，调用栈：\n",
+                 late / 1000,
+                 span ? span : "(未知)");
+        pthread_kill (main_thread,
+                      SIGUSR2);
+    }
+    g_mutex_unlock (&watchdog_lock);
+    return NULL;
+}
+
+void TraceInit (guint stall_ms,
+                guint events)
+{
+    main_thread = pthread_self ();
+    TraceThreadId ();
+    memset (&stats, 0, sizeof (stats));
+    if (events)
+    {
+        ring = g_new0 (TraceEvent, events);
+        ring_size = events;
+        ring_head = 0;
+    }
+    stall_us = stall_ms * 1000;
+    active = TRUE;
+
+    heartbeat = g_timeout_source_new (HEARTBEAT_MS);
+    g_source_set_callback (heartbeat,
+                           TraceHeartbeat,
+                           NULL,
+                           NULL);
+    g_source_attach (heartbeat,
+                     g_main_context_get_thread_default ());
+    if (!stall_us)
+        return;
+
+/*
+ * backtrace第一次调用时会加载libgcc，先在这里调用一次，之后在信号处理中不再分配内存
+ */
+    void *frames[1];
+    backtrace (frames,
+               1);
+    struct sigaction action;
+    memset (&action, 0, sizeof (action));
+    action.sa_handler = TraceBacktrace;
+    action.sa_flags = SA_RESTART;
+    sigemptyset (&action.sa_mask);
+    sigaction (SIGUSR2,
+               &action,
+               NULL);
+    watchdog_stop = FALSE;
+    watchdog = g_thread_new ("watchdog",
+                             TraceWatchdog,
+                             NULL);
+}
+
+void TraceShutdown (void)
+{
+    if (!active)
+        return;
+    if (watchdog)
+    {
+        g_mutex_lock (&watchdog_lock);
+        watchdog_stop = TRUE;
+        g_cond_signal (&watchdog_cond);
+        g_mutex_unlock (&watchdog_lock);
+        g_thread_join (watchdog);
+        watchdog = NULL;
+        signal (SIGUSR2,
+                SIG_DFL);
+    }
+    g_source_destroy (heartbeat);
+    g_source_unref (heartbeat);
+    heartbeat = NULL;
+    active = FALSE;
+    g_clear_pointer (&ring,
+                     g_free);
+    ring_size = 0;
+}
+
+/*
+ * 主线程中的区间同时记在main_span中，看门狗报告阻塞时打印它
+ */
+TraceSpan TraceBegin (const char *name)
+{
+    TraceSpan span = { name, 0, NULL };
+    if (!active)
+        return span;
+    span.start = g_get_monotonic_time ();
+    if (pthread_equal (pthread_self (),
+                       main_thread))
+    {
+        span.prev = main_span;
+        g_atomic_pointer_set (&main_span,
+                              name);
+    }
+    return span;
+}
+
+void TraceEnd (TraceSpan *span)
+{
+    if (!span->start)
+        return;
+    if (pthread_equal (pthread_self (),
+                       main_thread))
+        g_atomic_pointer_set (&main_span,
+                              span->prev);
+    if (ring)
+        TraceRecord (span->name,
+                     span->start,
+                     g_get_monotonic_time () - span->start);
+}
+
+/*
+ * 导出为Chrome trace-event格式，时间单位为微秒
+ */
+GBytes *TraceDump (void)
+{
+    GString *json = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    int      pid  = getpid ();
+    gint     threads = MIN (g_atomic_int_get (&thread_count),
+                            MAX_THREADS);
+    for (gint i = 0; i < threads; i++)
+        g_string_append_printf (json,
+                                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                                i ? "," : "",
+                                pid,
+                                i + 1,
+                                i == 0 ? "main" : thread_names[i]);
+
+    guint head  = g_atomic_int_get (&ring_head);
+    guint count = MIN (head, ring_size);
+    for (guint seq = head - count; seq != head; seq++)
+    {
+        TraceEvent event = ring[seq % ring_size];
+        if (g_atomic_int_get (&ring[seq % ring_size].seq) != seq + 1
+        || event.seq != seq + 1)
+            continue;
+        g_string_append_printf (json,
+                                ",\n{\"name\":\"%s\",\"cat\":\"soup_example\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                                "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT "}",
+                                event.name,
+                                pid,
+                                event.tid,
+                                event.start,
+                                event.dur);
+    }
+    g_string_append (json,
+                     "\n]}\n");
+    gsize length = json->len;
+    return g_bytes_new_take (g_string_free (json,
+                                            FALSE),
+                             length);
+}
+
+void TraceGetStats (TraceStats *out)
+{
+    g_mutex_lock (&stats_lock);
+    *out = stats;
+    g_mutex_unlock (&stats_lock);
+    guint head = g_atomic_int_get (&ring_head);
+    out->events = MIN (head, ring_size);
+}
@@ -0,0 +1,49 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <glib.h>
+
+/*
+ * 主循环阻塞检测与事件跟踪
+ * 心跳定时器测量主循环的调度延迟，看门狗线程在阻塞超过阈值时
+ * 打印当前正在执行的区间名和主线程的调用栈。
+ * 打开跟踪后，各区间(处理函数、声卡回调、Opus编解码)记录在环形缓冲区中，
+ * 可导出为Chrome trace-event格式的JSON，用chrome://tracing或Perfetto查看。
+ */
+
+typedef struct
+{
+    const char *name;
+    gint64      start;
+    const char *prev;
+} TraceSpan;
+
+typedef struct
+{
+    guint  beats;
+    guint  stalls;
+    gint64 total_latency_us;
+    gint64 max_latency_us;
+    guint  events;
+} TraceStats;
+
+/*
+ * stall_ms：阻塞阈值，为0时不启动看门狗
+ * events  ：环形缓冲区的事件数，为0时不记录区间
+ * 必须在主线程中调用，心跳定时器加到该线程的GMainContext中
+ */
+void TraceInit (guint stall_ms,
+                guint events);
+void TraceShutdown (void);
+
+/*
+ * name必须是静态字符串，缓冲区中只保存指针
+ * 可以在任何线程中调用，未初始化时几乎没有开销
+ */
+TraceSpan TraceBegin (const char *name);
+void TraceEnd (TraceSpan *span);
+
+GBytes *TraceDump (void);
+void TraceGetStats (TraceStats *stats);
+
+#endif
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <string.h>
+#include <gio/gio.h>
+#include "udp_util.h"
+
+#define MAX_DATAGRAM 1500
+
+struct _UdpChannel
+{
+    gint            ref;
+    GSocket        *socket;
+    GSource        *source;
+    GMainContext   *context;
+    UdpPacketFunc   func;
+    gpointer        user_data;
+    GMutex          lock;
+    GInetAddress   *peer_address;
+    GSocketAddress *peer;
+    guint16         seq;
+    guint32         ssrc;
+    gint64          last_receive;
+};
+
+typedef struct
+{
+    UdpChannel *channel;
+    GBytes     *datagram;
+} UdpDelayed;
+
+gboolean udp_enabled       = TRUE;
+gdouble  udp_emulate_loss  = 0;
+gint     udp_emulate_delay = 0;
+
+static UdpChannel *UdpChannelRef (UdpChannel *channel)
+{
+    g_atomic_int_inc (&channel->ref);
+    return channel;
+}
+
+static void UdpChannelUnref (UdpChannel *channel)
+{
+    if (!g_atomic_int_dec_and_test (&channel->ref))
+        return;
+    g_clear_object (&channel->peer);
+    g_clear_object (&channel->peer_address);
+    g_object_unref (channel->socket);
+    g_main_context_unref (channel->context);
+    g_mutex_clear (&channel->lock);
+    g_free (channel);
+}
+
+static gboolean UdpReceive (GSocket      *socket,
+                            GIOCondition  condition,
+                            gpointer      user_data)
+{
+    UdpChannel *channel = (UdpChannel *)user_data;
+    guchar      buffer[MAX_DATAGRAM];
+    for (;;)
+    {
+        GSocketAddress *from  = NULL;
+        gssize          size  = g_socket_receive_from (socket,
+                                                      &from,
+                                                       (gchar *)buffer,
+                                                       sizeof (buffer),
+                                                       NULL,
+                                                       NULL);
+        if (size < 0)
+            break;
+
+/*
+ * 只接受来自WebSocket对端主机的包，端口可能经过NAT变换，不做检查
+ */
+        gboolean accept = FALSE;
+        g_mutex_lock (&channel->lock);
+        if (channel->peer_address
+        && G_IS_INET_SOCKET_ADDRESS (from))
+            accept = g_inet_address_equal (channel->peer_address,
+                                           g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (from)));
+        g_mutex_unlock (&channel->lock);
+        g_clear_object (&from);
+
+        if (!accept
+        || size < RTP_HEADER_SIZE
+        || (buffer[0] & 0xc0) != 0x80
+        || (buffer[1] & 0x7f) != RTP_PAYLOAD_OPUS)
+            continue;
+        gsize header = RTP_HEADER_SIZE + (buffer[0] & 0x0f) * 4;
+        if (header > (gsize)size)
+            continue;
+
+        channel->last_receive = g_get_monotonic_time ();
+        channel->func ((buffer[2] << 8) | buffer[3],
+                       ((guint32)buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7],
+                       buffer + header,
+                       size - header,
+                       channel->user_data);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * 绑定到任意端口，接收在调用线程的GMainContext中进行
+ */
+UdpChannel *UdpChannelNew (GSocketFamily   family,
+                           UdpPacketFunc   func,
+                           gpointer        user_data,
+                           GError        **error)
+{
+    GSocket *socket = g_socket_new (family,
+                                    G_SOCKET_TYPE_DATAGRAM,
+                                    G_SOCKET_PROTOCOL_UDP,
+                                    error);
+    if (!socket)
+        return NULL;
+    GInetAddress   *any     = g_inet_address_new_any (family);
+    GSocketAddress *address = g_inet_socket_address_new (any,
+                                                         0);
+    gboolean ok = g_socket_bind (socket,
+                                 address,
+                                 FALSE,
+                                 error);
+    g_object_unref (address);
+    g_object_unref (any);
+    if (!ok)
+    {
+        g_object_unref (socket);
+        return NULL;
+    }
+    g_socket_set_blocking (socket,
+                           FALSE);
+
+    UdpChannel *channel = g_new0 (UdpChannel, 1);
+    channel->ref        = 1;
+    channel->socket     = socket;
+    channel->func       = func;
+    channel->user_data  = user_data;
+    channel->ssrc       = g_random_int ();
+    channel->context    = g_main_context_ref_thread_default ();
+    g_mutex_init (&channel->lock);
+    channel->source     = g_socket_create_source (socket,
+                                                  G_IO_IN,
+                                                  NULL);
+    g_source_set_callback (channel->source,
+                           (GSourceFunc)UdpReceive,
+                           channel,
+                           NULL);
+    g_source_attach (channel->source,
+                     channel->context);
+    return channel;
+}
+
+void UdpChannelFree (UdpChannel *channel)
+{
+    g_source_destroy (channel->source);
+    g_source_unref (channel->source);
+    g_socket_close (channel->socket,
+                    NULL);
+    UdpChannelUnref (channel);
+}
+
+guint16 UdpChannelGetPort (UdpChannel *channel)
+{
+    guint16         port    = 0;
+    GSocketAddress *address = g_socket_get_local_address (channel->socket,
+                                                          NULL);
+    if (address)
+    {
+        port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+        g_object_unref (address);
+    }
+    return port;
+}
+
+void UdpChannelSetPeer (UdpChannel   *channel,
+                        GInetAddress *address,
+                        guint16       port)
+{
+    g_mutex_lock (&channel->lock);
+    g_clear_object (&channel->peer);
+    g_clear_object (&channel->peer_address);
+    channel->peer_address = g_object_ref (address);
+    channel->peer = g_inet_socket_address_new (address,
+                                               port);
+    g_mutex_unlock (&channel->lock);
+}
+
+gboolean UdpChannelHasPeer (UdpChannel *channel)
+{
+    g_mutex_lock (&channel->lock);
+    gboolean has_peer = channel->peer != NULL;
+    g_mutex_unlock (&channel->lock);
+    return has_peer;
+}
+
+static gboolean UdpSendDatagram (UdpChannel   *channel,
+                                 const guchar *datagram,
+                                 gsize         size)
+{
+    g_mutex_lock (&channel->lock);
+    GSocketAddress *peer = channel->peer ? g_object_ref (channel->peer) : NULL;
+    g_mutex_unlock (&channel->lock);
+    if (!peer)
+        return FALSE;
+    gssize sent = g_socket_send_to (channel->socket,
+                                    peer,
+                                    (const gchar *)datagram,
+                                    size,
+                                    NULL,
+                                    NULL);
+    g_object_unref (peer);
+    return sent == (gssize)size;
+}
+
+static gboolean UdpSendDelayed (gpointer data)
+{
+    UdpDelayed *delayed = (UdpDelayed *)data;
+    gsize       size;
+    const guchar *datagram = g_bytes_get_data (delayed->datagram,
+                                              &size);
+    UdpSendDatagram (delayed->channel,
+                     datagram,
+                     size);
+    g_bytes_unref (delayed->datagram);
+    UdpChannelUnref (delayed->channel);
+    g_free (delayed);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * 可以在任何线程中调用
+ * size为0时发送探测/保活包，不占用序号
+ * 设置了--udp-loss/--udp-delay时按比例丢弃或延迟发送
+ */
+gboolean UdpChannelSend (UdpChannel   *channel,
+                         guint32       timestamp,
+                         const guchar *payload,
+                         gsize         size)
+{
+    guchar datagram[MAX_DATAGRAM];
+    if (size > MAX_DATAGRAM - RTP_HEADER_SIZE)
+        return FALSE;
+    guint16 seq = size ? channel->seq++ : channel->seq;
+    datagram[0]  = 0x80;
+    datagram[1]  = RTP_PAYLOAD_OPUS;
+    datagram[2]  = seq >> 8;
+    datagram[3]  = seq;
+    datagram[4]  = timestamp >> 24;
+    datagram[5]  = timestamp >> 16;
+    datagram[6]  = timestamp >> 8;
+    datagram[7]  = timestamp;
+    datagram[8]  = channel->ssrc >> 24;
+    datagram[9]  = channel->ssrc >> 16;
+    datagram[10] = channel->ssrc >> 8;
+    datagram[11] = channel->ssrc;
+    memcpy (datagram + RTP_HEADER_SIZE,
+            payload,
+            size);
+
+    if (udp_emulate_loss > 0
+    && g_random_double_range (0, 100) < udp_emulate_loss)
+        return TRUE;
+    if (udp_emulate_delay > 0)
+    {
+        UdpDelayed *delayed = g_new0 (UdpDelayed, 1);
+        delayed->channel    = UdpChannelRef (channel);
+        delayed->datagram   = g_bytes_new (datagram,
+                                           RTP_HEADER_SIZE + size);
+        GSource *source = g_timeout_source_new (udp_emulate_delay);
+        g_source_set_callback (source,
+                               UdpSendDelayed,
+                               delayed,
+                               NULL);
+        g_source_attach (source,
+                         channel->context);
+        g_source_unref (source);
+        return TRUE;
+    }
+    return UdpSendDatagram (channel,
+                            datagram,
+                            RTP_HEADER_SIZE + size);
+}
+
+/*
+ * 最后一次收到对端包的时间(g_get_monotonic_time)，从未收到时为0
+ */
+gint64 UdpChannelLastReceive (UdpChannel *channel)
+{
+    return channel->last_receive;
+}
@@ -0,0 +1,51 @@
+#ifndef _UDP_UTIL_H
+#define _UDP_UTIL_H
+
+#include <gio/gio.h>
+
+/*
+ * 音频的UDP旁路
+ * 通过/ws协商后，Opus包带上RTP格式的头(序号、时间戳)走UDP，
+ * 避免TCP重传造成的队头阻塞。不可用时由ws_util退回到WebSocket。
+ */
+
+#define RTP_HEADER_SIZE  12
+#define RTP_PAYLOAD_OPUS 111
+#define RTP_CLOCK_RATE   48000
+
+/*
+ * 收到一个包时在创建通道的线程的GMainContext中调用
+ * size为0的包是探测/保活包
+ */
+typedef void (*UdpPacketFunc) (guint16       seq,
+                               guint32       timestamp,
+                               const guchar *payload,
+                               gsize         size,
+                               gpointer      user_data);
+
+typedef struct _UdpChannel UdpChannel;
+
+/*
+ * 命令行选项，用于在回环上模拟丢包和延迟
+ */
+extern gboolean udp_enabled;
+extern gdouble  udp_emulate_loss;
+extern gint     udp_emulate_delay;
+
+UdpChannel *UdpChannelNew (GSocketFamily   family,
+                           UdpPacketFunc   func,
+                           gpointer        user_data,
+                           GError        **error);
+void UdpChannelFree (UdpChannel *channel);
+guint16 UdpChannelGetPort (UdpChannel *channel);
+void UdpChannelSetPeer (UdpChannel   *channel,
+                        GInetAddress *address,
+                        guint16       port);
+gboolean UdpChannelHasPeer (UdpChannel *channel);
+gboolean UdpChannelSend (UdpChannel   *channel,
+                         guint32       timestamp,
+                         const guchar *payload,
+                         gsize         size);
+gint64 UdpChannelLastReceive (UdpChannel *channel);
+
+#endif
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <libsoup/soup.h>
+#include <gio/gunixsocketaddress.h>
+#include "uds_util.h"
+
+#define MAX_HEADER_SIZE (64 * 1024)
+
+GIOStream *UdsConnect (const char  *path,
+                       GError     **error)
+{
+    GSocketClient  *client  = g_socket_client_new ();
+    GSocketAddress *address = g_unix_socket_address_new (path);
+    GSocketConnection *connection = g_socket_client_connect (client,
+                                                             G_SOCKET_CONNECTABLE (address),
+                                                             NULL,
+                                                             error);
+    g_object_unref (address);
+    g_object_unref (client);
+    return (GIOStream *)connection;
+}
+
+static gboolean UdsWriteRequest (GOutputStream  *out,
+                                 SoupMessage    *msg,
+                                 const char     *version,
+                                 GError        **error)
+{
+    SoupURI    *uri  = soup_message_get_uri (msg);
+    char       *path = soup_uri_to_string (uri,
+                                           TRUE);
+    SoupBuffer *body = soup_message_body_flatten (msg->request_body);
+    GString    *request = g_string_new (NULL);
+
+    g_string_append_printf (request,
+                            "%s %s %s\r\n",
+                            msg->method,
+                            path,
+                            version);
+    if (!soup_message_headers_get_one (msg->request_headers,
+                                       "Host"))
+        g_string_append_printf (request,
+                                "Host: %s\r\n",
+                                soup_uri_get_host (uri));
+    if (body->length)
+        soup_message_headers_set_content_length (msg->request_headers,
+                                                 body->length);
+
+    SoupMessageHeadersIter iter;
+    const char *name  = NULL;
+    const char *value = NULL;
+    soup_message_headers_iter_init (&iter,
+                                    msg->request_headers);
+    while (soup_message_headers_iter_next (&iter,
+                                           &name,
+                                           &value))
+        g_string_append_printf (request,
+                                "%s: %s\r\n",
+                                name,
+                                value);
+    g_string_append (request,
+                     "\r\n");
+
+    gboolean ok = g_output_stream_write_all (out,
+                                             request->str,
+                                             request->len,
+                                             NULL,
+                                             NULL,
+                                             error)
+               && (!body->length
+                || g_output_stream_write_all (out,
+                                              body->data,
+                                              body->length,
+                                              NULL,
+                                              NULL,
+                                              error));
+    g_string_free (request,
+                   TRUE);
+    soup_buffer_free (body);
+    g_free (path);
+    return ok;
+}
+
+/*
+ * 读取应答头，不能多读，否则会吞掉紧跟在后面的正文或WebSocket帧。
+ * 先用MSG_PEEK查看套接字中已有的数据，找到头部结尾后只取走头部，
+ * 通常一次peek加一次read即可，不必逐字节调用read。
+ */
+static gboolean UdsReadResponse (GIOStream    *connection,
+                                 SoupMessage  *msg,
+                                 GError      **error)
+{
+    GSocket      *socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (connection));
+    GInputStream *in     = g_io_stream_get_input_stream (connection);
+    GString      *header = g_string_new (NULL);
+    gboolean      ok     = FALSE;
+    gchar         buffer[4096];
+    for (;;)
+    {
+        gssize size = g_socket_receive_with_flags (socket,
+                                                   buffer,
+                                                   sizeof (buffer),
+                                                   MSG_PEEK,
+                                                   NULL,
+                                                   error);
+        if (size < 0)
+            goto err_read;
+        if (size == 0)
+        {
+            g_set_error_literal (error,
+                                 G_IO_ERROR,
+                                 G_IO_ERROR_CONNECTION_CLOSED,
+                                 "connection closed before response headers");
+            goto err_read;
+        }
+
+/*
+ * 头部结尾可能跨越两次peek，从上次末尾的前3个字节开始查找
+ */
+        gsize  old   = header->len;
+        gsize  from  = old > 3 ? old - 3 : 0;
+        g_string_append_len (header,
+                             buffer,
+                             size);
+        gchar *end   = g_strstr_len (header->str + from,
+                                     header->len - from,
+                                     "\r\n\r\n");
+        gsize  take  = size;
+        if (end)
+        {
+            g_string_truncate (header,
+                               end + 4 - header->str);
+            take = header->len - old;
+        }
+        if (!g_input_stream_read_all (in,
+                                      buffer,
+                                      take,
+                                      NULL,
+                                      NULL,
+                                      error))
+            goto err_read;
+        if (end)
+            break;
+        if (header->len >= MAX_HEADER_SIZE)
+        {
+            g_set_error_literal (error,
+                                 G_IO_ERROR,
+                                 G_IO_ERROR_INVALID_DATA,
+                                 "response headers too large");
+            goto err_read;
+        }
+    }
+
+    guint  status = 0;
+    char  *reason = NULL;
+    if (!soup_headers_parse_response (header->str,
+                                      header->len,
+                                      msg->response_headers,
+                                      NULL,
+                                     &status,
+                                     &reason))
+    {
+        g_set_error_literal (error,
+                             G_IO_ERROR,
+                             G_IO_ERROR_INVALID_DATA,
+                             "malformed response headers");
+        goto err_read;
+    }
+    soup_message_set_status_full (msg,
+                                  status,
+                                  reason);
+    g_free (reason);
+    ok = TRUE;
+err_read:
+    g_string_free (header,
+                   TRUE);
+    return ok;
+}
+
+static GIOStream *UdsRequest (const char   *path,
+                              SoupMessage  *msg,
+                              const char   *version,
+                              GError      **error)
+{
+    GIOStream *connection = UdsConnect (path,
+                                        error);
+    if (!connection)
+        return NULL;
+    if (!UdsWriteRequest (g_io_stream_get_output_stream (connection),
+                          msg,
+                          version,
+                          error)
+    || !UdsReadResponse (connection,
+                         msg,
+                         error))
+    {
+        g_object_unref (connection);
+        return NULL;
+    }
+    return connection;
+}
+
+/*
+ * 使用HTTP/1.0，服务器不会使用chunked编码，正文以Content-Length或关闭连接结束
+ */
+gboolean UdsSendMessage (const char   *path,
+                         SoupMessage  *msg,
+                         GError      **error)
+{
+    GIOStream *connection = UdsRequest (path,
+                                        msg,
+                                        "HTTP/1.0",
+                                        error);
+    if (!connection)
+        return FALSE;
+
+    GInputStream *in     = g_io_stream_get_input_stream (connection);
+    gboolean      ok     = TRUE;
+    goffset       length = -1;
+    if (soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH)
+        length = soup_message_headers_get_content_length (msg->response_headers);
+    while (length != 0)
+    {
+        gsize  count  = length < 0 || length > 8192 ? 8192 : length;
+        gchar *buffer = g_malloc (count);
+        gsize  size   = 0;
+        ok = g_input_stream_read_all (in,
+                                      buffer,
+                                      count,
+                                     &size,
+                                      NULL,
+                                      error);
+        if (!ok || size == 0)
+        {
+            g_free (buffer);
+            break;
+        }
+        soup_message_body_append (msg->response_body,
+                                  SOUP_MEMORY_TAKE,
+                                  buffer,
+                                  size);
+        if (length > 0)
+            length -= size;
+    }
+    if (ok && length > 0)
+    {
+        g_set_error_literal (error,
+                             G_IO_ERROR,
+                             G_IO_ERROR_PARTIAL_INPUT,
+                             "connection closed before end of body");
+        ok = FALSE;
+    }
+    soup_message_body_complete (msg->response_body);
+    g_object_unref (connection);
+    return ok;
+}
+
+/*
+ * 返回定位在正文开头的输入流，连接随输入流一起释放
+ */
+GInputStream *UdsSend (const char   *path,
+                       SoupMessage  *msg,
+                       GError      **error)
+{
+    GIOStream *connection = UdsRequest (path,
+                                        msg,
+                                        "HTTP/1.0",
+                                        error);
+    if (!connection)
+        return NULL;
+    GInputStream *in = g_object_ref (g_io_stream_get_input_stream (connection));
+    g_object_set_data_full (G_OBJECT (in),
+                            "uds-connection",
+                            connection,
+                            g_object_unref);
+    return in;
+}
+
+static void UdsSendThread (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
+{
+    SoupMessage  *msg   = (SoupMessage *)task_data;
+    GError       *error = NULL;
+    GInputStream *in    = UdsSend (g_object_get_data (G_OBJECT (task),
+                                                      "uds-path"),
+                                   msg,
+                                  &error);
+    if (in)
+        g_task_return_pointer (task,
+                               in,
+                               g_object_unref);
+    else
+        g_task_return_error (task,
+                             error);
+}
+
+/*
+ * 与soup_session_send_async对应，在工作线程中完成连接和读应答头
+ */
+void UdsSendAsync (const char          *path,
+                   SoupMessage         *msg,
+                   GCancellable        *cancellable,
+                   GAsyncReadyCallback  callback,
+                   gpointer             user_data)
+{
+    GTask *task = g_task_new (NULL,
+                              cancellable,
+                              callback,
+                              user_data);
+    g_object_set_data_full (G_OBJECT (task),
+                            "uds-path",
+                            g_strdup (path),
+                            g_free);
+    g_task_set_task_data (task,
+                          g_object_ref (msg),
+                          g_object_unref);
+    g_task_run_in_thread (task,
+                          UdsSendThread);
+    g_object_unref (task);
+}
+
+GInputStream *UdsSendFinish (GAsyncResult  *result,
+                             GError       **error)
+{
+    return g_task_propagate_pointer (G_TASK (result),
+                                     error);
+}
+
+/*
+ * WebSocket握手需要HTTP/1.1，握手成功后在同一连接上建立WebSocket
+ */
+SoupWebsocketConnection *UdsWebsocketConnect (const char   *path,
+                                              SoupMessage  *msg,
+                                              GError      **error)
+{
+    soup_websocket_client_prepare_handshake (msg,
+                                             NULL,
+                                             NULL);
+    GIOStream *connection = UdsRequest (path,
+                                        msg,
+                                        "HTTP/1.1",
+                                        error);
+    if (!connection)
+        return NULL;
+    if (!soup_websocket_client_verify_handshake (msg,
+                                                 error))
+    {
+        g_object_unref (connection);
+        return NULL;
+    }
+    SoupWebsocketConnection *websocket = soup_websocket_connection_new (connection,
+                                                                        soup_message_get_uri (msg),
+                                                                        SOUP_WEBSOCKET_CONNECTION_CLIENT,
+                                                                        NULL,
+                                                                        NULL);
+    g_object_unref (connection);
+    return websocket;
+}
@@ -0,0 +1,31 @@
+#ifndef _UDS_UTIL_H
+#define _UDS_UTIL_H
+
+#include <libsoup/soup.h>
+
+/*
+ * 通过Unix域套接字访问本机的服务器
+ * SoupSession(libsoup-2.4)只能连接TCP地址，这里直接在GSocketConnection上
+ * 收发HTTP报文，请求和应答仍然放在SoupMessage中，调用方式与SoupSession相同。
+ */
+
+GIOStream *UdsConnect (const char  *path,
+                       GError     **error);
+gboolean UdsSendMessage (const char   *path,
+                         SoupMessage  *msg,
+                         GError      **error);
+GInputStream *UdsSend (const char   *path,
+                       SoupMessage  *msg,
+                       GError      **error);
+void UdsSendAsync (const char          *path,
+                   SoupMessage         *msg,
+                   GCancellable        *cancellable,
+                   GAsyncReadyCallback  callback,
+                   gpointer             user_data);
+GInputStream *UdsSendFinish (GAsyncResult  *result,
+                             GError       **error);
+SoupWebsocketConnection *UdsWebsocketConnect (const char   *path,
+                                              SoupMessage  *msg,
+                                              GError      **error);
+
+#endif
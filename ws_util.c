@@ -1,210 +1,764 @@
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <libsoup/soup.h>
 #include <opus.h>
 #include <SDL2/SDL.h>
+#include "audio_resample.h"
+#include "sock_util.h"
+#include "udp_util.h"
+#include "trace.h"
+#include "log_util.h"
+#include "ws_util.h"
+
+/*
+ * Opus编码器的采样率和帧长(20ms)
+ * 声卡以原生格式打开，由audio_resample在两者之间转换
+ */
+#define CODEC_RATE      16000
+#define CODEC_FRAME     (CODEC_RATE / 1000 * 20)
+#define MAX_PACKET      4000
 
 GAsyncQueue *queue = NULL;
 OpusEncoder *encoder = NULL;
 OpusDecoder *decoder = NULL;
-SDL_AudioSpec spec;
+SDL_AudioSpec playback_spec;
+SDL_AudioSpec capture_spec;
 SDL_AudioDeviceID playback_id;
 SDL_AudioDeviceID capture_id;
 
+/*
+ * 采音：声卡样本 -> capture_mono(单声道) -> capture_pcm(CODEC_RATE，凑满一帧就编码)
+ * 放音：解码 -> playback_pcm(decoder_rate) -> playback_fifo(声卡采样率，单声道) -> 声卡
+ */
+AudioResampler capture_resampler;
+AudioResampler playback_resampler;
+float *capture_mono = NULL;
+float *capture_pcm = NULL;
+int    capture_fill = 0;
+float *playback_pcm = NULL;
+float *playback_fifo = NULL;
+int    playback_fill = 0;
+int    decoder_rate = CODEC_RATE;
+int    decoder_max_frame = 0;
+
+/*
+ * 时钟漂移补偿
+ * 对端采音声卡与本地放音声卡的晶振各自独立，长时间通话中队列会慢慢变长(延迟增加)
+ * 或慢慢变空(周期性断音)。这里用对端数据的到达速率与本地声卡的消耗速率估计漂移，
+ * 再加上按缓冲深度的小幅修正，调整放音重采样器的比例，使缓冲保持在目标深度。
+ * 发送端不发送静音帧，间隔超过DRIFT_GAP_US的包不计入到达速率。
+ */
+#define DRIFT_TARGET_MS   60
+#define DRIFT_GAP_US      100000
+#define DRIFT_WINDOW_US   10000000
+#define DRIFT_GAIN        0.05
+#define DRIFT_MAX         0.01
+
+typedef struct
+{
+    gint64 last_arrival;
+    int    last_samples;
+    gint64 arrival_us;
+    gint64 arrival_samples;
+    gint64 consume_start;
+    gint64 consume_frames;
+    double drift;
+    double ratio;
+} DriftState;
+
+DriftState drift;
+
+/*
+ * 接收队列中的包，seq为RTP序号，从WebSocket收到的包没有序号，为-1
+ */
+typedef struct
+{
+    GBytes *data;
+    gint32  seq;
+} AudioPacket;
+
+/*
+ * UDP旁路
+ * 双方在/ws上用文本消息协商：
+ *   "udp <端口>" 告知本端UDP端口，对端地址取WebSocket连接的对端地址
+ *   "udp-ok"     本端已收到对端的UDP包，对端可以改走UDP
+ *   "udp-lost"   本端超过UDP_TIMEOUT_US没有收到UDP包，对端退回WebSocket
+ * 双方每UDP_PROBE_MS发送一个探测包，静音期间也能判断UDP是否畅通。
+ */
+#define UDP_PROBE_MS     500
+#define UDP_TIMEOUT_US   2000000
+#define UDP_MAX_CONCEAL  5
+#define UDP_LOSS_PERC    5
+
+UdpChannel *udp = NULL;
+gint        udp_active = FALSE;
+gboolean    udp_receiving = FALSE;
+GSource    *udp_timer = NULL;
+/*
+ * udp_timestamp由采音回调递增、由音频线程读取，expected_seq由放音回调使用、
+ * 由音频线程在建立连接时复位，与udp_active一样用原子操作访问
+ */
+guint       udp_timestamp = 0;
+gint        expected_seq = -1;
+
+/*
+ * 采音可以同时供WebSocket会话和/listen的收听者使用，按引用计数打开和关闭
+ * capture_connection和capture_tap只在锁住采音设备时修改，采音回调中可以直接使用
+ * 广播在主循环中、WebSocket连接在音频线程中打开和关闭设备，SDL的子系统计数和设备表
+ * 都不是线程安全的，所有SDL_InitSubSystem/SDL_QuitSubSystem和设备的打开、关闭都在audio_lock中进行
+ */
+GMutex                   audio_lock;
+int                      capture_users = 0;
+SoupWebsocketConnection *capture_connection = NULL;
+CaptureTapFunc           capture_tap = NULL;
+gpointer                 capture_tap_data = NULL;
+
+/*
+ * Opus解码器可以直接输出这些采样率，声卡是这些采样率时放音不需要再转换
+ */
+static int OpusRate (int freq)
+{
+    switch (freq)
+    {
+        case 8000:
+        case 12000:
+        case 16000:
+        case 24000:
+        case 48000:
+            return freq;
+        default:
+            return CODEC_RATE;
+    }
+}
+
+static int FrameBytes (const SDL_AudioSpec *spec)
+{
+    return spec->channels * SDL_AUDIO_BITSIZE (spec->format) / 8;
+}
+
+static void AudioPacketFree (AudioPacket *packet)
+{
+    g_bytes_unref (packet->data);
+    g_free (packet);
+}
+
+/*
+ * 放入接收队列，同时记录到达时间用于估计时钟漂移
+ */
+static void AudioPacketPush (GBytes *data,
+                             gint32  seq)
+{
+    gsize         size;
+    gconstpointer bytes   = g_bytes_get_data (data,
+                                             &size);
+    int           samples = opus_packet_get_nb_samples (bytes,
+                                                        size,
+                                                        48000);
+    gint64        now     = g_get_monotonic_time ();
+    AudioPacket  *packet  = g_new (AudioPacket, 1);
+    packet->data = data;
+    packet->seq  = seq;
+
+    g_async_queue_lock (queue);
+    if (g_async_queue_length_unlocked (queue) > 1000)
+        AudioPacketFree (g_async_queue_pop_unlocked (queue));
+    g_async_queue_push_unlocked (queue,
+                                 packet);
+    if (drift.last_arrival
+    && now - drift.last_arrival < DRIFT_GAP_US)
+    {
+        drift.arrival_us += now - drift.last_arrival;
+        drift.arrival_samples += drift.last_samples;
+    }
+    drift.last_arrival = now;
+    drift.last_samples = samples > 0 ? samples : 0;
+    g_async_queue_unlock (queue);
+}
+
+static void UdpPacket (guint16       seq,
+                       guint32       timestamp,
+                       const guchar *payload,
+                       gsize         size,
+                       gpointer      user_data)
+{
+    SoupWebsocketConnection *connection = (SoupWebsocketConnection *)user_data;
+    if (size)
+        AudioPacketPush (g_bytes_new (payload,
+                                      size),
+                         seq);
+    if (!udp_receiving
+    && SOUP_WEBSOCKET_STATE_OPEN == soup_websocket_connection_get_state (connection))
+    {
+        udp_receiving = TRUE;
+        soup_websocket_connection_send_text (connection,
+                                             "udp-ok");
+    }
+}
+
+/*
+ * 定时发送探测包，并检查对端的UDP包是否还在到达
+ */
+static gboolean UdpTimer (gpointer user_data)
+{
+    SoupWebsocketConnection *connection = (SoupWebsocketConnection *)user_data;
+    if (UdpChannelHasPeer (udp))
+        UdpChannelSend (udp,
+                        g_atomic_int_get (&udp_timestamp),
+                        NULL,
+                        0);
+    if (udp_receiving
+    && g_get_monotonic_time () - UdpChannelLastReceive (udp) > UDP_TIMEOUT_US
+    && SOUP_WEBSOCKET_STATE_OPEN == soup_websocket_connection_get_state (connection))
+    {
+        udp_receiving = FALSE;
+        soup_websocket_connection_send_text (connection,
+                                             "udp-lost");
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void UdpSignal (SoupWebsocketConnection *connection,
+                       const char              *text)
+{
+    guint port = 0;
+    if (sscanf (text, "udp %u", &port) == 1)
+    {
+        GSocket        *socket  = SockStreamSocket (soup_websocket_connection_get_io_stream (connection));
+        GSocketAddress *address = socket ? g_socket_get_remote_address (socket,
+                                                                        NULL)
+                                         : NULL;
+        if (udp
+        && port
+        && port < 65536
+        && address
+        && G_IS_INET_SOCKET_ADDRESS (address))
+            UdpChannelSetPeer (udp,
+                               g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (address)),
+                               port);
+        g_clear_object (&address);
+    }
+    else if (strcmp (text, "udp-ok") == 0)
+    {
+        g_atomic_int_set (&udp_active,
+                          TRUE);
+        LOG_INFO ("音频改走UDP。");
+    }
+    else if (strcmp (text, "udp-lost") == 0)
+    {
+        g_atomic_int_set (&udp_active,
+                          FALSE);
+        LOG_INFO ("UDP不通，音频退回WebSocket。");
+    }
+}
+
+/*
+ * 二进制消息是音频，文本消息是UDP旁路的协商
+ */
 void WsMessage(SoupWebsocketConnection *connection,
                gint                     type,
                GBytes                  *message,
                gpointer                 user_data)
 {
+    TraceSpan span = TraceBegin ("ws.message");
+    if (type == SOUP_WEBSOCKET_DATA_TEXT)
+    {
+        gsize         size;
+        gconstpointer data = g_bytes_get_data (message,
+                                              &size);
+        gchar        *text = g_strndup (data,
+                                        size);
+        UdpSignal (connection,
+                   text);
+        g_free (text);
+    }
+    else
+        AudioPacketPush (g_bytes_ref (message),
+                         -1);
+    TraceEnd (&span);
+}
+
+/*
+ * 在放音回调中调用，frames为本次交给声卡的样本数
+ */
+static void DriftUpdate (int frames)
+{
+    gint64 now = g_get_monotonic_time ();
+    if (!drift.consume_start)
+        drift.consume_start = now;
+    drift.consume_frames += frames;
+
     g_async_queue_lock (queue);
-    if (g_async_queue_length_unlocked (queue) > 1000)
-        g_bytes_unref (g_async_queue_pop_unlocked (queue));
-    g_async_queue_push_unlocked (queue,
-                                 message);
-    g_bytes_ref (message);
+    int      queued  = g_async_queue_length_unlocked (queue);
+    gboolean updated = FALSE;
+    if (drift.arrival_us >= DRIFT_WINDOW_US
+    && now > drift.consume_start)
+    {
+        double arrival = drift.arrival_samples / 48000.0
+                       / (drift.arrival_us / 1000000.0);
+        double consume = drift.consume_frames / (double)playback_spec.freq
+                       / ((now - drift.consume_start) / 1000000.0);
+        drift.drift = drift.drift * 0.8 + arrival / consume * 0.2;
+        drift.arrival_us = 0;
+        drift.arrival_samples = 0;
+        drift.consume_start = now;
+        drift.consume_frames = 0;
+        updated = TRUE;
+    }
     g_async_queue_unlock (queue);
+
+    double ratio = drift.drift;
+    if (queued
+    || playback_fill)
+    {
+        double depth = queued * 20.0
+                     + playback_fill * 1000.0 / playback_spec.freq;
+        ratio += CLAMP ((depth - DRIFT_TARGET_MS) / 1000.0 * DRIFT_GAIN,
+                        -DRIFT_MAX / 2,
+                        DRIFT_MAX / 2);
+    }
+    ratio = CLAMP (ratio,
+                   1 - DRIFT_MAX,
+                   1 + DRIFT_MAX);
+    if (fabs (ratio - drift.ratio) > 0.000001)
+    {
+        AudioResamplerSetRatio (&playback_resampler,
+                                ratio);
+        drift.ratio = ratio;
+    }
+    if (updated)
+        LOG_INFO ("时钟偏差：%.1f ppm，缓冲：%d包。",
+                  (drift.drift - 1) * 1000000,
+                  queued);
 }
 
 void WsClose (SoupWebsocketConnection *connection,
               gpointer                 user_data)
 {
+    TraceSpan span = TraceBegin ("ws.close");
+    g_mutex_lock (&audio_lock);
     SDL_CloseAudioDevice(playback_id);
-    puts ("关闭放音设备");
-    SDL_CloseAudioDevice(capture_id);
-    puts ("关闭采音设备");
-    opus_encoder_destroy (encoder);
+    g_mutex_unlock (&audio_lock);
+    LOG_INFO ("关闭放音设备");
+/*
+ * 收听者可能还在使用采音，这里只断开本连接
+ */
+    SDL_LockAudioDevice (capture_id);
+    capture_connection = NULL;
+    udp_active = FALSE;
+    SDL_UnlockAudioDevice (capture_id);
+    CaptureRelease ();
     opus_decoder_destroy (decoder);
+    g_free (playback_pcm);
+    g_free (playback_fifo);
+    if (udp_timer)
+    {
+        g_source_destroy (udp_timer);
+        g_source_unref (udp_timer);
+        udp_timer = NULL;
+    }
+    if (udp)
+    {
+        UdpChannelFree (udp);
+        udp = NULL;
+    }
     while (g_async_queue_length(queue))
-        g_bytes_unref (g_async_queue_pop (queue));
+        AudioPacketFree (g_async_queue_pop (queue));
     g_async_queue_unref (queue);
     g_object_unref (connection);
-    SDL_Quit();
+    g_mutex_lock (&audio_lock);
+    SDL_QuitSubSystem (SDL_INIT_AUDIO);
+    g_mutex_unlock (&audio_lock);
+    TraceEnd (&span);
+}
+
+/*
+ * 解码一个包并转换到声卡采样率，data为NULL时做丢包补偿(PLC)，
+ * fec为1时从data中恢复它前面丢失的那个包
+ */
+static void PlaybackDecode (const guchar *data,
+                            gsize         size,
+                            int           frame_size,
+                            int           fec)
+{
+    TraceSpan span    = TraceBegin ("opus.decode");
+    int       decoded = opus_decode_float (decoder,
+                                           data,
+                                           size,
+                                           playback_pcm,
+                                           frame_size,
+                                           fec);
+    TraceEnd (&span);
+    if (decoded > 0)
+        playback_fill += AudioResample (&playback_resampler,
+                                        playback_pcm,
+                                        decoded,
+                                        playback_fifo + playback_fill);
+    else
+        LOG_ERROR ("解码失败[%d]：%s",
+                   decoded,
+                   opus_strerror (decoded));
+}
+
+/*
+ * 按RTP序号检查丢包：紧挨着当前包的那一帧用当前包里的FEC恢复，
+ * 更早丢失的帧用PLC补偿(合计最多UDP_MAX_CONCEAL个)，迟到的包直接丢弃
+ * 返回FALSE表示该包应丢弃
+ */
+static gboolean PlaybackConceal (AudioPacket *packet)
+{
+    gint expected = g_atomic_int_get (&expected_seq);
+    if (packet->seq < 0)
+    {
+        g_atomic_int_set (&expected_seq,
+                          -1);
+        return TRUE;
+    }
+    if (expected >= 0)
+    {
+        guint16 gap = (guint16)(packet->seq - expected);
+        if (gap >= 0x8000)
+            return FALSE;
+        gsize         size;
+        const guchar *data  = g_bytes_get_data (packet->data,
+                                               &size);
+        int           frame = opus_packet_get_nb_samples (data,
+                                                          size,
+                                                          decoder_rate);
+        if (frame <= 0)
+            frame = decoder_rate / 50;
+        if (gap > 0)
+        {
+            for (int i = 1; i < gap && i < UDP_MAX_CONCEAL; i++)
+                PlaybackDecode (NULL,
+                                0,
+                                frame,
+                                0);
+            PlaybackDecode (data,
+                            size,
+                            frame,
+                            1);
+        }
+    }
+    g_atomic_int_set (&expected_seq,
+                      (guint16)(packet->seq + 1));
+    return TRUE;
 }
 
 void PlayAudio (void  *userdata,
                 Uint8 *stream,
                 int    len)
 {
+    TraceSpan span = TraceBegin ("audio.playback");
     SDL_memset (stream, '\0', len);
-    GBytes *buffer = NULL;
-    g_async_queue_lock(queue);
-    if (g_async_queue_length_unlocked (queue))
-        buffer = g_async_queue_pop_unlocked (queue);
-    g_async_queue_unlock(queue);
-    if (buffer)
-    {
-        float *pcm = (float *)malloc(len);
-    
-        int size = opus_decode_float (decoder,
-                                      g_bytes_get_data (buffer,
-                                                        NULL),
-                                      g_bytes_get_size (buffer),
-                                      pcm,
-                                      spec.samples,
-                                      0);
-        if (size > 0)
-            SDL_memcpy (stream,
-                        pcm,
-                        len);
+    int frames = len / FrameBytes (&playback_spec);
+    while (playback_fill < frames)
+    {
+        AudioPacket *packet = NULL;
+        g_async_queue_lock(queue);
+        if (g_async_queue_length_unlocked (queue))
+            packet = g_async_queue_pop_unlocked (queue);
+        g_async_queue_unlock(queue);
+        if (!packet)
+            break;
+
+        if (PlaybackConceal (packet))
+            PlaybackDecode (g_bytes_get_data (packet->data,
+                                              NULL),
+                            g_bytes_get_size (packet->data),
+                            decoder_max_frame,
+                            0);
+        AudioPacketFree (packet);
+    }
 
+    int count = MIN (frames, playback_fill);
+    if (count)
+    {
+        if (playback_spec.format == AUDIO_F32SYS)
+            AudioUpmixF32 (playback_fifo,
+                           count,
+                           playback_spec.channels,
+                           (float *)stream);
         else
-        {
-            fprintf (stderr,
-                     "解码结果[%d]。\n",
-                     size);
-            fprintf (stderr,
-                     " %d: Ok\n",
-                     OPUS_OK);
-            fprintf (stderr,
-                     "%d: Bad arg\n",
-                     OPUS_BAD_ARG);
-            fprintf (stderr,
-                     "%d: Buffer too small\n",
-                     OPUS_BUFFER_TOO_SMALL);
-            fprintf (stderr,
-                     "%d: Internal error\n",
-                     OPUS_INTERNAL_ERROR);
-            fprintf (stderr,
-                     "%d: Unimplemented\n",
-                     OPUS_UNIMPLEMENTED);
-            fprintf (stderr,
-                     "%d: Invalid state\n",
-                     OPUS_INVALID_STATE);
-            fprintf (stderr,
-                     "%d: Alloc fail\n",
-                     OPUS_ALLOC_FAIL);
-        }
-        free (pcm);
-        g_bytes_unref (buffer);
+            AudioUpmixS16 (playback_fifo,
+                           count,
+                           playback_spec.channels,
+                           (int16_t *)stream);
+        playback_fill -= count;
+        memmove (playback_fifo,
+                 playback_fifo + count,
+                 playback_fill * sizeof (float));
     }
+    DriftUpdate (frames);
+    TraceEnd (&span);
 }
 
 void CaptAudio (void  *userdata,
                 Uint8 *stream,
                 int    len)
 {
-    SoupWebsocketConnection *connection = (SoupWebsocketConnection *)userdata;
-    unsigned char *encoded = malloc (len);
-    gsize size = opus_encode_float (encoder,
-                                    (float *)stream,
-                                    spec.samples,
-                                    encoded,
-                                    len);
-    if (size > 0)
+    SoupWebsocketConnection *connection = capture_connection;
+    TraceSpan     span = TraceBegin ("audio.capture");
+    unsigned char encoded[MAX_PACKET];
+    int frames = len / FrameBytes (&capture_spec);
+    if (capture_spec.format == AUDIO_F32SYS)
+        AudioDownmixF32 ((const float *)stream,
+                         frames,
+                         capture_spec.channels,
+                         capture_mono);
+    else
+        AudioDownmixS16 ((const int16_t *)stream,
+                         frames,
+                         capture_spec.channels,
+                         capture_mono);
+    capture_fill += AudioResample (&capture_resampler,
+                                   capture_mono,
+                                   frames,
+                                   capture_pcm + capture_fill);
+
+    int offset = 0;
+    for (; capture_fill - offset >= CODEC_FRAME; offset += CODEC_FRAME)
     {
-        if (SOUP_WEBSOCKET_STATE_OPEN == soup_websocket_connection_get_state (connection)
+        TraceSpan  encode = TraceBegin ("opus.encode");
+        opus_int32 size   = opus_encode_float (encoder,
+                                               capture_pcm + offset,
+                                               CODEC_FRAME,
+                                               encoded,
+                                               MAX_PACKET);
+        TraceEnd (&encode);
+        if (size > 0)
+        {
 /*
  * 如果没有采集到样本数据，则编码后的数据长度为8
  * 这里的判断表示没有采集到数据时，则不进行数据发送，这样可以节省一些带宽       
  * 该值会随着freq、sample的值而变化，具体需要测试来确定
  */
-        && size > 8)
-        {
-            soup_websocket_connection_send_binary (connection,
-                                                   encoded,
-                                                   size);
+            if (size > 8
+            && connection)
+            {
+                if (g_atomic_int_get (&udp_active))
+                    UdpChannelSend (udp,
+                                    g_atomic_int_get (&udp_timestamp),
+                                    encoded,
+                                    size);
+                else if (SOUP_WEBSOCKET_STATE_OPEN == soup_websocket_connection_get_state (connection))
+                    soup_websocket_connection_send_binary (connection,
+                                                           encoded,
+                                                           size);
+            }
+/*
+ * 广播需要连续的包(包括静音)才能得到正确的时间
+ */
+            if (capture_tap)
+                capture_tap (encoded,
+                             size,
+                             capture_tap_data);
         }
+        else
+            LOG_ERROR ("编码失败[%d]：%s",
+                       size,
+                       opus_strerror (size));
+        g_atomic_int_add (&udp_timestamp,
+                          CODEC_FRAME * (RTP_CLOCK_RATE / CODEC_RATE));
     }
-    else
-    {
-        fprintf (stderr,
-                 "解码结果[%d]。\n",
-                 (int)size);
-        fprintf (stderr,
-                 " %d: Ok\n",
-                 OPUS_OK);
-        fprintf (stderr,
-                 "%d: Bad arg\n",
-                 OPUS_BAD_ARG);
-        fprintf (stderr,
-                 "%d: Buffer too small\n",
-                 OPUS_BUFFER_TOO_SMALL);
-        fprintf (stderr,
-                 "%d: Internal error\n",
-                 OPUS_INTERNAL_ERROR);
-        fprintf (stderr,
-                 "%d: Unimplemented\n",
-                 OPUS_UNIMPLEMENTED);
-        fprintf (stderr,
-                 "%d: Invalid state\n",
-                 OPUS_INVALID_STATE);
-        fprintf (stderr,
-                 "%d: Alloc fail\n",
-                 OPUS_ALLOC_FAIL);
-    }
-    free (encoded);
+    capture_fill -= offset;
+    memmove (capture_pcm,
+             capture_pcm + offset,
+             capture_fill * sizeof (float));
+    TraceEnd (&span);
 }
 
-void ConnectionInit (SoupWebsocketConnection *connection,
-                     const char *playback_device,
-                     const char *capture_device)
+/*
+ * 按声卡常见的原生格式请求，并允许SDL改用声卡实际的采样率、声道数和样本格式，
+ * 这样SDL不再做任何转换，实际得到的格式分别记录在playback_spec和capture_spec中。
+ * 回调只处理S16和F32，声卡的原生格式是其他格式时重新打开，由SDL转换成S16
+ */
+static SDL_AudioDeviceID AudioOpen (const char        *device,
+                                    int                iscapture,
+                                    SDL_AudioCallback  callback,
+                                    SDL_AudioSpec     *obtained)
 {
-    SDL_Init (SDL_INIT_AUDIO);
+    SDL_AudioSpec spec;
     SDL_zero(spec);
-    spec.freq = 16000;
-    spec.format = AUDIO_F32SYS;
-    spec.channels = 1;
+    spec.freq = 48000;
+    spec.format = AUDIO_S16SYS;
+    spec.channels = 2;
     spec.samples = spec.freq / 1000 * 20;
-    spec.callback = PlayAudio;
+    spec.callback = callback;
+    SDL_AudioDeviceID id = SDL_OpenAudioDevice (device,
+                                                iscapture,
+                                               &spec,
+                                                obtained,
+                                                SDL_AUDIO_ALLOW_FREQUENCY_CHANGE
+                                              | SDL_AUDIO_ALLOW_CHANNELS_CHANGE
+                                              | SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+    if (!id
+    || obtained->format == AUDIO_S16SYS
+    || obtained->format == AUDIO_F32SYS)
+        return id;
+    SDL_CloseAudioDevice (id);
+    return SDL_OpenAudioDevice (device,
+                                iscapture,
+                               &spec,
+                                obtained,
+                                SDL_AUDIO_ALLOW_FREQUENCY_CHANGE
+                              | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+}
 
-    playback_id = SDL_OpenAudioDevice(playback_device,
-                                      FALSE,
-                                     &spec,
-                                      NULL,
-                                      0);
-    if (!playback_id)
+/*
+ * 第一个使用者打开采音设备和编码器，之后的使用者只增加计数
+ */
+gboolean CaptureAcquire (const char *capture_device)
+{
+    g_mutex_lock (&audio_lock);
+    if (capture_users++)
     {
-        fprintf (stderr,
-                 "无法打开放音设备[%s]：%s\n",
-                 playback_device,
-                 SDL_GetError());
-        goto err_open_playback;
+        g_mutex_unlock (&audio_lock);
+        return TRUE;
     }
-
-    spec.callback = CaptAudio;
-    spec.userdata = connection;
-
-    capture_id = SDL_OpenAudioDevice (capture_device,
-                                      SDL_TRUE,
-                                     &spec,
-                                      NULL,
-                                      0);
+    SDL_InitSubSystem (SDL_INIT_AUDIO);
+    capture_id = AudioOpen (capture_device,
+                            SDL_TRUE,
+                            CaptAudio,
+                           &capture_spec);
     if (!capture_id)
     {
-        fprintf (stderr,
-                 "无法打开采音设备[%s]：%s\n",
-                 capture_device,
-                 SDL_GetError());
-        goto err_open_capture;
+        LOG_ERROR ("无法打开采音设备[%s]：%s",
+                   capture_device,
+                   SDL_GetError());
+        SDL_QuitSubSystem (SDL_INIT_AUDIO);
+        capture_users = 0;
+        g_mutex_unlock (&audio_lock);
+        return FALSE;
     }
+    LOG_INFO ("采音设备：%d Hz，%d声道。",
+              capture_spec.freq,
+              capture_spec.channels);
 
-    encoder = opus_encoder_create(spec.freq,
-                                  spec.channels,
+    encoder = opus_encoder_create(CODEC_RATE,
+                                  1,
                                   OPUS_APPLICATION_VOIP,
                                   NULL);
-    decoder = opus_decoder_create(spec.freq,
-                                  spec.channels,
+/*
+ * 带内FEC，UDP丢一个包时可以从下一个包中恢复
+ */
+    opus_encoder_ctl (encoder,
+                      OPUS_SET_INBAND_FEC (1));
+    opus_encoder_ctl (encoder,
+                      OPUS_SET_PACKET_LOSS_PERC (UDP_LOSS_PERC));
+    AudioResamplerInit (&capture_resampler,
+                        capture_spec.freq,
+                        CODEC_RATE);
+    capture_mono = g_new (float, capture_spec.samples);
+    capture_pcm = g_new (float, CODEC_FRAME + AudioResamplerMaxOutput (&capture_resampler,
+                                                                       capture_spec.samples));
+    capture_fill = 0;
+    SDL_PauseAudioDevice(capture_id,
+                         SDL_FALSE);
+    LOG_INFO ("打开采音设备。");
+    g_mutex_unlock (&audio_lock);
+    return TRUE;
+}
+
+void CaptureRelease (void)
+{
+    g_mutex_lock (&audio_lock);
+    if (--capture_users)
+    {
+        g_mutex_unlock (&audio_lock);
+        return;
+    }
+    SDL_CloseAudioDevice(capture_id);
+    LOG_INFO ("关闭采音设备");
+    opus_encoder_destroy (encoder);
+    g_free (capture_mono);
+    g_free (capture_pcm);
+    capture_mono = NULL;
+    capture_pcm = NULL;
+    SDL_QuitSubSystem (SDL_INIT_AUDIO);
+    g_mutex_unlock (&audio_lock);
+}
+
+/*
+ * 每个编码后的包(包括静音时的小包)都在采音回调中交给func，func为NULL时取消
+ */
+void CaptureSetTap (CaptureTapFunc func,
+                    gpointer       user_data)
+{
+    g_mutex_lock (&audio_lock);
+    if (capture_users)
+        SDL_LockAudioDevice (capture_id);
+    capture_tap = func;
+    capture_tap_data = user_data;
+    if (capture_users)
+        SDL_UnlockAudioDevice (capture_id);
+    g_mutex_unlock (&audio_lock);
+}
+
+/*
+ * 编码器的前瞻，以48kHz的样本数表示，用于Ogg Opus的pre-skip
+ */
+int CaptureLookahead (void)
+{
+    opus_int32 lookahead = 0;
+    g_mutex_lock (&audio_lock);
+    if (capture_users)
+        opus_encoder_ctl (encoder,
+                          OPUS_GET_LOOKAHEAD (&lookahead));
+    g_mutex_unlock (&audio_lock);
+    return lookahead * (48000 / CODEC_RATE);
+}
+
+void ConnectionInit (SoupWebsocketConnection *connection,
+                     const char *playback_device,
+                     const char *capture_device)
+{
+    g_mutex_lock (&audio_lock);
+    SDL_InitSubSystem (SDL_INIT_AUDIO);
+    playback_id = AudioOpen (playback_device,
+                             SDL_FALSE,
+                             PlayAudio,
+                            &playback_spec);
+    g_mutex_unlock (&audio_lock);
+    if (!playback_id)
+    {
+        LOG_ERROR ("无法打开放音设备[%s]：%s",
+                   playback_device,
+                   SDL_GetError());
+        goto err_open_playback;
+    }
+    LOG_INFO ("放音设备：%d Hz，%d声道。",
+              playback_spec.freq,
+              playback_spec.channels);
+    if (!CaptureAcquire (capture_device))
+        goto err_open_capture;
+
+    decoder_rate = OpusRate (playback_spec.freq);
+    decoder = opus_decoder_create(decoder_rate,
+                                  1,
                                   NULL);
 
+/*
+ * 所有缓冲区的大小都按实际得到的格式计算
+ */
+    AudioResamplerInit (&playback_resampler,
+                        decoder_rate,
+                        playback_spec.freq);
+    decoder_max_frame = decoder_rate / 1000 * 120;
+    playback_pcm = g_new (float, decoder_max_frame);
+    playback_fifo = g_new (float, playback_spec.samples + AudioResamplerMaxOutput (&playback_resampler,
+                                                                                   decoder_max_frame * (UDP_MAX_CONCEAL + 1)));
+    playback_fill = 0;
+    memset (&drift, 0, sizeof (drift));
+    drift.drift = 1.0;
+    drift.ratio = 1.0;
+
+/*
+ * 音频连接：关闭Nagle、限制发送缓冲、标记DSCP EF
+ */
+    SockProfileApply (SockStreamFd (soup_websocket_connection_get_io_stream (connection)),
+                      &sock_profile_audio);
+
     g_signal_connect (connection,
                       "message",
                       G_CALLBACK (WsMessage),
@@ -214,18 +768,70 @@ void ConnectionInit (SoupWebsocketConnection *connection,
                       G_CALLBACK (WsClose),
                       NULL);
     queue = g_async_queue_new();
+
+/*
+ * 建立UDP旁路，把端口告诉对端；对端确认收到UDP包之前音频仍走WebSocket
+ */
+    udp_active = FALSE;
+    udp_receiving = FALSE;
+    g_atomic_int_set (&expected_seq,
+                      -1);
+    GSocket        *socket  = SockStreamSocket (soup_websocket_connection_get_io_stream (connection));
+    GSocketAddress *address = socket ? g_socket_get_remote_address (socket,
+                                                                    NULL)
+                                     : NULL;
+    if (udp_enabled
+    && address
+    && G_IS_INET_SOCKET_ADDRESS (address))
+    {
+        GError *error = NULL;
+        udp = UdpChannelNew (g_socket_address_get_family (address),
+                             UdpPacket,
+                             connection,
+                            &error);
+        if (error)
+        {
+            LOG_WARNING ("无法建立UDP通道：%s",
+                         error->message);
+            g_error_free (error);
+            error = NULL;
+        }
+    }
+    g_clear_object (&address);
+    if (udp)
+    {
+        gchar *text = g_strdup_printf ("udp %u",
+                                       UdpChannelGetPort (udp));
+        soup_websocket_connection_send_text (connection,
+                                             text);
+        g_free (text);
+        udp_timer = g_timeout_source_new (UDP_PROBE_MS);
+        g_source_set_callback (udp_timer,
+                               UdpTimer,
+                               connection,
+                               NULL);
+        g_source_attach (udp_timer,
+                         g_main_context_get_thread_default ());
+    }
+    SDL_LockAudioDevice (capture_id);
+    capture_connection = connection;
+    g_atomic_int_set (&udp_timestamp,
+                      0);
+    SDL_UnlockAudioDevice (capture_id);
     SDL_PauseAudioDevice (playback_id,
                           SDL_FALSE);
-    puts("打开放音设备。");
-    SDL_PauseAudioDevice(capture_id,
-                         SDL_FALSE);
-    puts("打开采音设备。");
+    LOG_INFO ("打开放音设备。");
     g_object_ref (connection);
 
     return;
 err_open_capture:
+    g_mutex_lock (&audio_lock);
     SDL_CloseAudioDevice(playback_id);
+    g_mutex_unlock (&audio_lock);
 err_open_playback:
+    g_mutex_lock (&audio_lock);
+    SDL_QuitSubSystem (SDL_INIT_AUDIO);
+    g_mutex_unlock (&audio_lock);
 err_connection:
     return;
 }
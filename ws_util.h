@@ -9,8 +9,20 @@ typedef struct
     const char *capture_device;
 } WsInfo;
 
+/*
+ * 在采音回调(声卡线程)中调用，packet为一帧编码后的Opus包
+ */
+typedef void (*CaptureTapFunc) (const unsigned char *packet,
+                                int                  size,
+                                gpointer             user_data);
+
 void ConnectionInit (SoupWebsocketConnection *,
                      const char *,
                      const char *);
+gboolean CaptureAcquire (const char *capture_device);
+void CaptureRelease (void);
+void CaptureSetTap (CaptureTapFunc func,
+                    gpointer       user_data);
+int CaptureLookahead (void);
 
 #endif